@@ -11,13 +11,76 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+import io.airlift.astack.AStack;
+
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+
 public class AStackTest
 {
     public static void main(String[] args)
             throws InterruptedException
     {
+        AStack.setContext(42, "test-context");
+        AStack.armDeadline(500);
+
+        String folded = new String(AStack.snapshot(AStack.Format.FOLDED), StandardCharsets.UTF_8);
+        if (!folded.contains("[test-context];AStackTest.main;")) {
+            throw new AssertionError("snapshot is missing the main thread: " + folded);
+        }
+
+        contend();
+        allocate();
+        fail();
+
         System.out.println("Sleeping...");
         Thread.sleep(Integer.parseInt(args[0]) * 1000);
         System.out.println("Done!");
     }
+
+    private static void contend()
+            throws InterruptedException
+    {
+        Object lock = new Object();
+        Thread contender = new Thread(() -> {
+            synchronized (lock) {
+                // blocks until main releases the lock
+            }
+        }, "contender");
+        synchronized (lock) {
+            contender.start();
+            Thread.sleep(200);
+        }
+        contender.join();
+
+        // a wait that times out
+        synchronized (lock) {
+            lock.wait(50);
+        }
+    }
+
+    private static Object[] allocate()
+    {
+        Object[] objects = new Object[100_000];
+        for (int i = 0; i < objects.length; i++) {
+            objects[i] = new ArrayList<>();
+        }
+        // a pause for the GC timeline
+        System.gc();
+        return objects;
+    }
+
+    private static int fail()
+    {
+        int failures = 0;
+        for (int i = 0; i < 1000; i++) {
+            try {
+                Integer.parseInt("not a number");
+            }
+            catch (NumberFormatException e) {
+                failures++;
+            }
+        }
+        return failures;
+    }
 }
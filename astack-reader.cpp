@@ -0,0 +1,1097 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Offline reader for binary snapshot streams, spool segments and ring
+// files written by the agent. Files are mapped into memory, and strings
+// and frames are used in place rather than copied. Only the records of a
+// ring are copied out first, since the agent keeps overwriting them.
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "astack_format.h"
+
+// JVMTI thread state bits, as stored in thread and sample records
+static const int32_t STATE_ALIVE = 0x0001;
+static const int32_t STATE_TERMINATED = 0x0002;
+static const int32_t STATE_RUNNABLE = 0x0004;
+static const int32_t STATE_WAITING_INDEFINITELY = 0x0010;
+static const int32_t STATE_WAITING_WITH_TIMEOUT = 0x0020;
+static const int32_t STATE_SLEEPING = 0x0040;
+static const int32_t STATE_IN_OBJECT_WAIT = 0x0100;
+static const int32_t STATE_PARKED = 0x0200;
+static const int32_t STATE_BLOCKED_ON_MONITOR_ENTER = 0x0400;
+
+static const int32_t NATIVE_METHOD_LINENO = -3;
+static const uint32_t FRAME_SIZE = 12;
+
+enum OutputFormat {
+   OUTPUT_TEXT,
+   OUTPUT_FOLDED,
+   OUTPUT_PPROF,
+   OUTPUT_JSON,
+};
+
+struct StringView {
+   const char *data = "";
+   size_t size = 0;
+
+   std::string str() const
+   {
+      return std::string(data, size);
+   }
+
+   bool equals(const char *value) const
+   {
+      return (strlen(value) == size) && (memcmp(data, value, size) == 0);
+   }
+};
+
+// frames of a thread or stack record, left in the mapped file
+struct FramesView {
+   const uint8_t *data = nullptr;
+   uint32_t count = 0;
+};
+
+// line number table of a method, as entries of i64 start, i32 line
+struct LineTableView {
+   const uint8_t *data = nullptr;
+   uint32_t count = 0;
+};
+
+struct Method {
+   StringView class_name;
+   StringView method_name;
+   StringView source_name;
+};
+
+// method IDs and stack IDs are only meaningful within one stream or segment
+struct Dictionary {
+   std::unordered_map<uint64_t, Method> methods;
+   std::unordered_map<uint32_t, FramesView> stacks;
+   std::unordered_map<uint32_t, StringView> thread_names;
+   std::unordered_map<int64_t, StringView> context_labels;
+   std::unordered_map<uint64_t, LineTableView> line_tables;
+};
+
+// a thread of a snapshot, or a sample
+struct Event {
+   int64_t time_millis;
+   int64_t snapshot_id; // -1 for samples
+   uint32_t tid;
+   int32_t state;
+   bool daemon;
+   int32_t priority;
+   int64_t context_id;
+   StringView context_label;
+   StringView name;
+   StringView reason; // of a final capture
+   FramesView frames;
+   bool raw; // frames have bytecode indexes rather than lines
+   const Dictionary *dictionary;
+};
+
+// bounds checked little-endian reads, failing once past the end
+struct Reader {
+   const uint8_t *p;
+   const uint8_t *end;
+   bool failed = false;
+
+   Reader(const uint8_t *start, const uint8_t *limit) : p(start), end(limit) {}
+
+   const uint8_t *skip(size_t size);
+   uint8_t u8();
+   uint16_t u16();
+   uint32_t u32();
+   uint64_t u64();
+   StringView str();
+};
+
+struct Options {
+   OutputFormat format = OUTPUT_TEXT;
+   int64_t from = INT64_MIN;
+   int64_t to = INT64_MAX;
+   const char *thread = nullptr;
+   int64_t tid = -1;
+   std::vector<std::string> class_prefixes;
+   std::vector<std::string> methods;
+   bool thread_names = false;
+};
+
+static Options options;
+static std::vector<std::unique_ptr<Dictionary>> dictionaries;
+static std::vector<Event> events;
+static std::vector<std::unique_ptr<std::vector<uint8_t>>> ring_copies;
+
+const uint8_t *Reader::skip(size_t size)
+{
+   if (failed || ((size_t) (end - p) < size)) {
+      failed = true;
+      return nullptr;
+   }
+   const uint8_t *start = p;
+   p += size;
+   return start;
+}
+
+static uint32_t getU32(const uint8_t *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t getU64(const uint8_t *p)
+{
+   return getU32(p) | ((uint64_t) getU32(p + 4) << 32);
+}
+
+uint8_t Reader::u8()
+{
+   const uint8_t *value = skip(1);
+   return value ? value[0] : 0;
+}
+
+uint16_t Reader::u16()
+{
+   const uint8_t *value = skip(2);
+   return value ? (value[0] | (value[1] << 8)) : 0;
+}
+
+uint32_t Reader::u32()
+{
+   const uint8_t *value = skip(4);
+   return value ? getU32(value) : 0;
+}
+
+uint64_t Reader::u64()
+{
+   const uint8_t *value = skip(8);
+   return value ? getU64(value) : 0;
+}
+
+StringView Reader::str()
+{
+   StringView view;
+   uint16_t size = u16();
+   const uint8_t *value = skip(size);
+   if (value != nullptr) {
+      view.data = (const char *) value;
+      view.size = size;
+   }
+   return view;
+}
+
+static bool parseLong(const char *value, int64_t *result)
+{
+   char *end;
+   errno = 0;
+   long long parsed = strtoll(value, &end, 10);
+   if ((errno != 0) || (end == value) || (*end != '\0')) {
+      return false;
+   }
+   *result = parsed;
+   return true;
+}
+
+static void splitList(const char *text, std::vector<std::string> *values)
+{
+   const char *start = text;
+   while (true) {
+      const char *comma = strchr(start, ',');
+      size_t len = comma ? (size_t) (comma - start) : strlen(start);
+      if (len > 0) {
+         values->emplace_back(start, len);
+      }
+      if (comma == nullptr) {
+         break;
+      }
+      start = comma + 1;
+   }
+}
+
+static void formatTime(int64_t millis, char *buffer, size_t size)
+{
+   time_t seconds = millis / 1000;
+   tm utc;
+   gmtime_r(&seconds, &utc);
+   size_t len = strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &utc);
+   snprintf(buffer + len, size - len, ".%03dZ", (int) (millis % 1000));
+}
+
+static const char *threadStateEnum(int32_t state)
+{
+   if (state & STATE_ALIVE) {
+      if (state & STATE_RUNNABLE) {
+         return "RUNNABLE";
+      }
+      if (state & STATE_BLOCKED_ON_MONITOR_ENTER) {
+         return "BLOCKED (on object monitor)";
+      }
+      if (state & STATE_WAITING_INDEFINITELY) {
+         if (state & STATE_IN_OBJECT_WAIT) {
+            return "WAITING (on object monitor)";
+         }
+         if (state & STATE_PARKED) {
+            return "WAITING (parking)";
+         }
+         return "WAITING";
+      }
+      if (state & STATE_WAITING_WITH_TIMEOUT) {
+         if (state & STATE_IN_OBJECT_WAIT) {
+            return "TIMED_WAITING (on object monitor)";
+         }
+         if (state & STATE_PARKED) {
+            return "TIMED_WAITING (parking)";
+         }
+         if (state & STATE_SLEEPING) {
+            return "TIMED_WAITING (sleeping)";
+         }
+         return "TIMED_WAITING";
+      }
+      return "UNKNOWN";
+   }
+   if (state & STATE_TERMINATED) {
+      return "TERMINATED";
+   }
+   return "NEW";
+}
+
+static uint64_t frameMethod(const FramesView &frames, uint32_t index)
+{
+   return getU64(frames.data + (index * FRAME_SIZE));
+}
+
+static int32_t frameLine(const Event &event, uint32_t index)
+{
+   int32_t line = getU32(event.frames.data + (index * FRAME_SIZE) + 8);
+   if (!event.raw || (line < 0)) {
+      return line;
+   }
+
+   // the entry with the greatest start not after the bytecode index
+   auto found = event.dictionary->line_tables.find(frameMethod(event.frames, index));
+   if (found == event.dictionary->line_tables.end()) {
+      return -1;
+   }
+   int32_t result = -1;
+   int64_t best = -1;
+   for (uint32_t i = 0; i < found->second.count; i++) {
+      const uint8_t *entry = found->second.data + (i * FRAME_SIZE);
+      int64_t start = getU64(entry);
+      if ((start <= line) && (start > best)) {
+         best = start;
+         result = getU32(entry + 8);
+      }
+   }
+   if (found->second.count == 1) {
+      result = getU32(found->second.data + 8);
+   }
+   return result;
+}
+
+static const Method *findMethod(const Dictionary *dictionary, uint64_t id)
+{
+   auto found = dictionary->methods.find(id);
+   if (found != dictionary->methods.end()) {
+      return &found->second;
+   }
+
+   static Method unknown;
+   unknown.class_name.data = "Unknown";
+   unknown.class_name.size = 7;
+   unknown.method_name = unknown.class_name;
+   return &unknown;
+}
+
+static FramesView readFrames(Reader *reader)
+{
+   FramesView frames;
+   uint32_t count = reader->u32();
+   if (count > (size_t) (reader->end - reader->p) / FRAME_SIZE) {
+      reader->failed = true;
+      return frames;
+   }
+   frames.data = reader->skip(count * FRAME_SIZE);
+   frames.count = count;
+   return frames;
+}
+
+static bool methodMatches(const Method *method)
+{
+   bool class_match = options.class_prefixes.empty();
+   for (const std::string &prefix : options.class_prefixes) {
+      if ((method->class_name.size >= prefix.size()) && (memcmp(method->class_name.data, prefix.data(), prefix.size()) == 0)) {
+         class_match = true;
+         break;
+      }
+   }
+   bool method_match = options.methods.empty();
+   for (const std::string &name : options.methods) {
+      if (method->method_name.equals(name.c_str())) {
+         method_match = true;
+         break;
+      }
+   }
+   return class_match && method_match;
+}
+
+static bool eventMatches(const Event &event)
+{
+   if ((event.time_millis < options.from) || (event.time_millis > options.to)) {
+      return false;
+   }
+   if ((options.tid >= 0) && (event.tid != (uint64_t) options.tid)) {
+      return false;
+   }
+   if ((options.thread != nullptr) && !event.name.equals(options.thread)) {
+      return false;
+   }
+   if (options.class_prefixes.empty() && options.methods.empty()) {
+      return true;
+   }
+   for (uint32_t i = 0; i < event.frames.count; i++) {
+      if (methodMatches(findMethod(event.dictionary, frameMethod(event.frames, i)))) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static void addEvent(const Event &event)
+{
+   if (eventMatches(event)) {
+      events.push_back(event);
+   }
+}
+
+// read method, stack, thread name and context label records into the
+// dictionary, and thread and sample records into events
+static bool readRecords(const char *path, const uint8_t *start, const uint8_t *end, Dictionary *dictionary)
+{
+   Reader reader(start, end);
+   int64_t snapshot_id = -1;
+   int64_t snapshot_time = 0;
+   StringView snapshot_reason;
+   StringView reason;
+
+   while (reader.p < reader.end) {
+      // concatenated streams, such as the pages of a dump, repeat the header
+      if (((size_t) (reader.end - reader.p) >= sizeof(ASTACK_MAGIC)) &&
+            (memcmp(reader.p, ASTACK_MAGIC, sizeof(ASTACK_MAGIC)) == 0)) {
+         reader.skip(sizeof(ASTACK_MAGIC));
+         if (reader.u16() != ASTACK_VERSION) {
+            fprintf(stderr, "ERROR: %s: unsupported version\n", path);
+            return false;
+         }
+         continue;
+      }
+
+      uint8_t type = reader.u8();
+      uint32_t length = reader.u32();
+      const uint8_t *payload = reader.skip(length);
+      if (payload == nullptr) {
+         fprintf(stderr, "WARNING: %s: truncated record at offset %zu\n", path, (size_t) (reader.p - start));
+         break;
+      }
+
+      Reader record(payload, payload + length);
+      Event event = {};
+      event.dictionary = dictionary;
+      switch (type) {
+         case ASTACK_RECORD_SNAPSHOT:
+            snapshot_id = record.u64();
+            snapshot_time = record.u64();
+            snapshot_reason = reason;
+            reason = StringView();
+            break;
+         case ASTACK_RECORD_GASP:
+            record.u64();
+            reason = record.str();
+            break;
+         case ASTACK_RECORD_METHOD: {
+            uint64_t id = record.u64();
+            Method &method = dictionary->methods[id];
+            method.class_name = record.str();
+            method.method_name = record.str();
+            method.source_name = record.str();
+            break;
+         }
+         case ASTACK_RECORD_THREAD:
+            event.time_millis = snapshot_time;
+            event.snapshot_id = snapshot_id;
+            event.reason = snapshot_reason;
+            event.tid = record.u32();
+            event.state = record.u32();
+            event.daemon = record.u8();
+            event.priority = record.u32();
+            event.context_id = record.u64();
+            event.context_label = record.str();
+            event.name = record.str();
+            event.frames = readFrames(&record);
+            if (!record.failed) {
+               addEvent(event);
+            }
+            break;
+         case ASTACK_RECORD_STACK: {
+            uint32_t id = record.u32();
+            dictionary->stacks[id] = readFrames(&record);
+            break;
+         }
+         case ASTACK_RECORD_THREAD_NAME: {
+            uint32_t tid = record.u32();
+            dictionary->thread_names[tid] = record.str();
+            break;
+         }
+         case ASTACK_RECORD_CONTEXT_LABEL: {
+            int64_t id = record.u64();
+            dictionary->context_labels[id] = record.str();
+            break;
+         }
+         case ASTACK_RECORD_LINE_TABLE: {
+            uint64_t id = record.u64();
+            FramesView entries = readFrames(&record);
+            LineTableView &table = dictionary->line_tables[id];
+            table.data = entries.data;
+            table.count = entries.count;
+            break;
+         }
+         case ASTACK_RECORD_RAW_SAMPLE: {
+            event.time_millis = record.u64();
+            event.snapshot_id = -1;
+            event.tid = record.u32();
+            event.state = record.u32();
+            event.context_id = record.u64();
+            event.frames = readFrames(&record);
+            event.raw = true;
+            auto name = dictionary->thread_names.find(event.tid);
+            if (name != dictionary->thread_names.end()) {
+               event.name = name->second;
+            }
+            auto label = dictionary->context_labels.find(event.context_id);
+            if (label != dictionary->context_labels.end()) {
+               event.context_label = label->second;
+            }
+            if (!record.failed) {
+               addEvent(event);
+            }
+            break;
+         }
+         case ASTACK_RECORD_SAMPLE: {
+            event.time_millis = record.u64();
+            event.snapshot_id = -1;
+            event.tid = record.u32();
+            event.state = record.u32();
+            event.context_id = record.u64();
+            uint32_t id = record.u32();
+            auto stack = dictionary->stacks.find(id);
+            auto name = dictionary->thread_names.find(event.tid);
+            if (name != dictionary->thread_names.end()) {
+               event.name = name->second;
+            }
+            auto label = dictionary->context_labels.find(event.context_id);
+            if (label != dictionary->context_labels.end()) {
+               event.context_label = label->second;
+            }
+            if (!record.failed && (stack != dictionary->stacks.end())) {
+               event.frames = stack->second;
+               addEvent(event);
+            }
+            break;
+         }
+         default:
+            // cursors, and records of later versions
+            break;
+      }
+      if (record.failed) {
+         fprintf(stderr, "WARNING: %s: invalid record of type %d\n", path, type);
+      }
+   }
+   return true;
+}
+
+// the dictionary first, then the data area between the index entries
+// bounding the time range
+static bool readSegment(const char *path, const uint8_t *data, size_t size)
+{
+   uint32_t data_end = getU32(data + ASTACK_SEGMENT_DATA_END);
+   uint32_t dictionary_start = getU32(data + ASTACK_SEGMENT_DICTIONARY_START);
+   uint32_t index_count = getU32(data + ASTACK_SEGMENT_INDEX_COUNT);
+   uint32_t index_capacity = getU32(data + ASTACK_SEGMENT_INDEX_CAPACITY);
+   uint64_t data_start = ASTACK_SEGMENT_INDEX + ((uint64_t) index_capacity * ASTACK_SEGMENT_INDEX_ENTRY_SIZE);
+   if ((index_count > index_capacity) || (data_start > data_end) || (data_end > dictionary_start) || (dictionary_start > size)) {
+      fprintf(stderr, "ERROR: %s: invalid segment header\n", path);
+      return false;
+   }
+
+   dictionaries.emplace_back(new Dictionary());
+   Dictionary *dictionary = dictionaries.back().get();
+   if (!readRecords(path, data + dictionary_start, data + size, dictionary)) {
+      return false;
+   }
+
+   uint64_t start = data_start;
+   uint64_t end = data_end;
+   for (uint32_t i = 0; i < index_count; i++) {
+      const uint8_t *entry = data + ASTACK_SEGMENT_INDEX + (i * ASTACK_SEGMENT_INDEX_ENTRY_SIZE);
+      int64_t time = getU64(entry);
+      uint32_t offset = getU32(entry + 8);
+      if ((offset < data_start) || (offset > data_end)) {
+         break;
+      }
+      if (time <= options.from) {
+         start = offset;
+      }
+      else if (time > options.to) {
+         end = offset;
+         break;
+      }
+   }
+   // the agent writes thread names and context labels again after each
+   // index entry, so the data before the start is not needed
+   return readRecords(path, data + start, data + end, dictionary);
+}
+
+static uint64_t loadAcquire(const uint8_t *p)
+{
+   return __atomic_load_n((const uint64_t *) p, __ATOMIC_ACQUIRE);
+}
+
+// Copy the records from the latest dictionary up to the head, and retry
+// if the agent overwrote them in the meantime.
+static bool readRing(const char *path, const uint8_t *data, size_t size)
+{
+   uint64_t capacity = getU32(data + ASTACK_RING_DATA_CAPACITY);
+   if ((capacity == 0) || ((capacity % 8) != 0) || (size < ASTACK_RING_HEADER_SIZE + capacity)) {
+      fprintf(stderr, "ERROR: %s: invalid ring header\n", path);
+      return false;
+   }
+   const uint8_t *ring = data + ASTACK_RING_HEADER_SIZE;
+
+   ring_copies.emplace_back(new std::vector<uint8_t>());
+   std::vector<uint8_t> *copy = ring_copies.back().get();
+   for (int attempt = 0; attempt < 8; attempt++) {
+      uint64_t start = loadAcquire(data + ASTACK_RING_DICTIONARY);
+      uint64_t head = loadAcquire(data + ASTACK_RING_HEAD);
+      bool torn = false;
+
+      copy->clear();
+      for (uint64_t sequence = start; sequence < head; ) {
+         const uint8_t *record = ring + (sequence % capacity);
+         uint64_t length = getU32(record + 1);
+         uint64_t record_size = (ASTACK_RECORD_HEADER_SIZE + length + 7) & ~7ULL;
+         if (((sequence % capacity) + record_size) > capacity) {
+            torn = true;
+            break;
+         }
+         if (record[0] != 0) {
+            copy->insert(copy->end(), record, record + ASTACK_RECORD_HEADER_SIZE + length);
+         }
+         sequence += record_size;
+      }
+
+      if (!torn && (loadAcquire(data + ASTACK_RING_TAIL) <= start)) {
+         dictionaries.emplace_back(new Dictionary());
+         return readRecords(path, copy->data(), copy->data() + copy->size(), dictionaries.back().get());
+      }
+   }
+   fprintf(stderr, "ERROR: %s: ring is overwritten faster than it can be read\n", path);
+   return false;
+}
+
+static bool readFile(const char *path)
+{
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      fprintf(stderr, "ERROR: failed to open %s: %s\n", path, strerror(errno));
+      return false;
+   }
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      fprintf(stderr, "ERROR: failed to stat %s: %s\n", path, strerror(errno));
+      close(fd);
+      return false;
+   }
+   size_t size = st.st_size;
+   if (size < ASTACK_SEGMENT_START_TIME) {
+      fprintf(stderr, "ERROR: %s: not an AStack file\n", path);
+      close(fd);
+      return false;
+   }
+
+   // the mapping stays alive until exit, since events refer into it
+   void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "ERROR: failed to map %s: %s\n", path, strerror(errno));
+      return false;
+   }
+   const uint8_t *data = (const uint8_t *) map;
+
+   if (memcmp(data, ASTACK_MAGIC, sizeof(ASTACK_MAGIC)) != 0) {
+      fprintf(stderr, "ERROR: %s: not an AStack file\n", path);
+      return false;
+   }
+   if ((size >= ASTACK_SEGMENT_INDEX) && (data[6] == ASTACK_RECORD_SEGMENT)) {
+      return readSegment(path, data, size);
+   }
+   if ((size >= ASTACK_RING_HEADER_SIZE) && (data[6] == 0)) {
+      return readRing(path, data, size);
+   }
+
+   dictionaries.emplace_back(new Dictionary());
+   return readRecords(path, data, data + size, dictionaries.back().get());
+}
+
+static void printFrameText(const Method *method, int32_t line, FILE *out)
+{
+   int class_size = method->class_name.size;
+   int method_size = method->method_name.size;
+   int source_size = method->source_name.size;
+   const char *class_text = method->class_name.data;
+   const char *method_text = method->method_name.data;
+   const char *source_text = method->source_name.data;
+
+   if (line == NATIVE_METHOD_LINENO) {
+      fprintf(out, "%.*s.%.*s(Native Method)", class_size, class_text, method_size, method_text);
+   }
+   else if (source_size == 0) {
+      fprintf(out, "%.*s.%.*s(Unknown Source)", class_size, class_text, method_size, method_text);
+   }
+   else if (line <= 0) {
+      fprintf(out, "%.*s.%.*s(%.*s)", class_size, class_text, method_size, method_text, source_size, source_text);
+   }
+   else {
+      fprintf(out, "%.*s.%.*s(%.*s:%d)", class_size, class_text, method_size, method_text, source_size, source_text, line);
+   }
+}
+
+static void writeText(FILE *out)
+{
+   int64_t snapshot_id = -1;
+   int64_t time = -1;
+   char text[32];
+
+   for (const Event &event : events) {
+      if ((event.snapshot_id != snapshot_id) || ((event.snapshot_id < 0) && (event.time_millis != time))) {
+         formatTime(event.time_millis, text, sizeof(text));
+         if (event.reason.size > 0) {
+            fprintf(out, "Snapshot %lld at %s (%.*s)\n\n", (long long) event.snapshot_id, text, (int) event.reason.size, event.reason.data);
+         }
+         else if (event.snapshot_id >= 0) {
+            fprintf(out, "Snapshot %lld at %s\n\n", (long long) event.snapshot_id, text);
+         }
+         else {
+            fprintf(out, "Sample at %s\n\n", text);
+         }
+         snapshot_id = event.snapshot_id;
+         time = event.time_millis;
+      }
+
+      int name_size = event.name.size;
+      if (event.snapshot_id >= 0) {
+         fprintf(out, "\"%.*s\"%s prio=%d\n", name_size, event.name.data, event.daemon ? " daemon" : "", event.priority);
+      }
+      else {
+         fprintf(out, "\"%.*s\" tid=%u\n", name_size, event.name.data, event.tid);
+      }
+      fprintf(out, "  java.lang.Thread.Stage: %s\n", threadStateEnum(event.state));
+
+      if ((event.context_id != 0) || (event.context_label.size > 0)) {
+         fprintf(out, "  astack.context:");
+         if (event.context_id != 0) {
+            fprintf(out, " id=%lld", (long long) event.context_id);
+         }
+         if (event.context_label.size > 0) {
+            fprintf(out, " label=%.*s", (int) event.context_label.size, event.context_label.data);
+         }
+         fprintf(out, "\n");
+      }
+
+      for (uint32_t i = 0; i < event.frames.count; i++) {
+         fprintf(out, "\tat ");
+         printFrameText(findMethod(event.dictionary, frameMethod(event.frames, i)), frameLine(event, i), out);
+         fprintf(out, "\n");
+      }
+      fprintf(out, "\n");
+   }
+}
+
+static void appendFoldedName(std::string &stack, const StringView &name)
+{
+   // semicolons separate frames in the folded format
+   for (size_t i = 0; i < name.size; i++) {
+      stack += (name.data[i] == ';') ? '_' : name.data[i];
+   }
+}
+
+static void writeFolded(FILE *out)
+{
+   std::map<std::string, int64_t> stacks;
+   std::string stack;
+
+   for (const Event &event : events) {
+      stack.clear();
+
+      // the context is the root frame, as in folded dumps of the agent
+      if (event.context_label.size > 0) {
+         stack += '[';
+         appendFoldedName(stack, event.context_label);
+         stack += ']';
+      }
+      else if (event.context_id != 0) {
+         stack += "[" + std::to_string((long long) event.context_id) + "]";
+      }
+      if (options.thread_names) {
+         if (!stack.empty()) {
+            stack += ';';
+         }
+         stack += '[';
+         appendFoldedName(stack, event.name);
+         stack += ']';
+      }
+
+      for (int i = event.frames.count - 1; i >= 0; i--) {
+         const Method *method = findMethod(event.dictionary, frameMethod(event.frames, i));
+         if (!stack.empty()) {
+            stack += ';';
+         }
+         appendFoldedName(stack, method->class_name);
+         stack += '.';
+         appendFoldedName(stack, method->method_name);
+      }
+
+      if (!stack.empty()) {
+         stacks[stack]++;
+      }
+   }
+
+   for (const auto &entry : stacks) {
+      fprintf(out, "%s %lld\n", entry.first.c_str(), (long long) entry.second);
+   }
+}
+
+static void writeJsonString(const StringView &value, FILE *out)
+{
+   fputc('"', out);
+   for (size_t i = 0; i < value.size; i++) {
+      unsigned char c = value.data[i];
+      if ((c == '"') || (c == '\\')) {
+         fprintf(out, "\\%c", c);
+      }
+      else if (c < 0x20) {
+         fprintf(out, "\\u%04x", c);
+      }
+      else {
+         fputc(c, out);
+      }
+   }
+   fputc('"', out);
+}
+
+static void writeJson(FILE *out)
+{
+   fprintf(out, "[");
+   for (size_t i = 0; i < events.size(); i++) {
+      const Event &event = events[i];
+      fprintf(out, "%s\n  {\"time\": %lld", (i == 0) ? "" : ",", (long long) event.time_millis);
+      if (event.snapshot_id >= 0) {
+         fprintf(out, ", \"snapshot\": %lld", (long long) event.snapshot_id);
+      }
+      if (event.reason.size > 0) {
+         fprintf(out, ", \"reason\": ");
+         writeJsonString(event.reason, out);
+      }
+      fprintf(out, ", \"thread\": ");
+      writeJsonString(event.name, out);
+      fprintf(out, ", \"tid\": %u, \"state\": \"%s\"", event.tid, threadStateEnum(event.state));
+      if (event.snapshot_id >= 0) {
+         fprintf(out, ", \"daemon\": %s, \"priority\": %d", event.daemon ? "true" : "false", event.priority);
+      }
+      if ((event.context_id != 0) || (event.context_label.size > 0)) {
+         fprintf(out, ", \"context\": {\"id\": %lld, \"label\": ", (long long) event.context_id);
+         writeJsonString(event.context_label, out);
+         fprintf(out, "}");
+      }
+
+      fprintf(out, ", \"frames\": [");
+      for (uint32_t j = 0; j < event.frames.count; j++) {
+         const Method *method = findMethod(event.dictionary, frameMethod(event.frames, j));
+         fprintf(out, "%s{\"class\": ", (j == 0) ? "" : ", ");
+         writeJsonString(method->class_name, out);
+         fprintf(out, ", \"method\": ");
+         writeJsonString(method->method_name, out);
+         fprintf(out, ", \"file\": ");
+         writeJsonString(method->source_name, out);
+         fprintf(out, ", \"line\": %d}", frameLine(event, j));
+      }
+      fprintf(out, "]}");
+   }
+   fprintf(out, "\n]\n");
+}
+
+// protocol buffer message, encoded as it is built
+struct ProtoWriter {
+   std::string out;
+
+   void varint(uint64_t value);
+   void key(int field, int wire_type);
+   void uint(int field, uint64_t value);
+   void bytes(int field, const std::string &value);
+   void packed(int field, const std::vector<uint64_t> &values);
+};
+
+void ProtoWriter::varint(uint64_t value)
+{
+   while (value >= 0x80) {
+      out += (char) ((value & 0x7F) | 0x80);
+      value >>= 7;
+   }
+   out += (char) value;
+}
+
+void ProtoWriter::key(int field, int wire_type)
+{
+   varint((field << 3) | wire_type);
+}
+
+void ProtoWriter::uint(int field, uint64_t value)
+{
+   key(field, 0);
+   varint(value);
+}
+
+void ProtoWriter::bytes(int field, const std::string &value)
+{
+   key(field, 2);
+   varint(value.size());
+   out += value;
+}
+
+void ProtoWriter::packed(int field, const std::vector<uint64_t> &values)
+{
+   ProtoWriter payload;
+   for (uint64_t value : values) {
+      payload.varint(value);
+   }
+   bytes(field, payload.out);
+}
+
+// Profile message of pprof (profile.proto), with one sample per distinct
+// stack and thread. Functions are keyed by name, since method IDs differ
+// between files. The output is not compressed, which pprof accepts.
+static void writePprof(FILE *out)
+{
+   std::unordered_map<std::string, uint64_t> strings;
+   std::vector<const std::string *> string_table;
+   auto string = [&](const std::string &value) {
+      auto inserted = strings.emplace(value, strings.size());
+      if (inserted.second) {
+         string_table.push_back(&inserted.first->first);
+      }
+      return inserted.first->second;
+   };
+   string("");
+
+   ProtoWriter profile;
+   ProtoWriter message;
+   std::map<std::string, uint64_t> functions;
+   std::map<std::pair<uint64_t, int32_t>, uint64_t> locations;
+   std::map<std::pair<std::vector<uint64_t>, std::string>, int64_t> samples;
+   int64_t start = INT64_MAX;
+
+   for (const Event &event : events) {
+      std::vector<uint64_t> stack;
+      for (uint32_t i = 0; i < event.frames.count; i++) {
+         const Method *method = findMethod(event.dictionary, frameMethod(event.frames, i));
+         std::string name = method->class_name.str() + "." + method->method_name.str();
+         std::string key = name + '\0' + method->source_name.str();
+         auto function = functions.emplace(key, functions.size() + 1);
+         if (function.second) {
+            message.out.clear();
+            message.uint(1, function.first->second);
+            message.uint(2, string(name));
+            message.uint(3, string(name));
+            message.uint(4, string(method->source_name.str()));
+            profile.bytes(5, message.out);
+         }
+
+         int32_t line = std::max(frameLine(event, i), 0);
+         auto location = locations.emplace(std::make_pair(function.first->second, line), locations.size() + 1);
+         if (location.second) {
+            ProtoWriter line_message;
+            line_message.uint(1, function.first->second);
+            line_message.uint(2, line);
+            message.out.clear();
+            message.uint(1, location.first->second);
+            message.bytes(4, line_message.out);
+            profile.bytes(4, message.out);
+         }
+         stack.push_back(location.first->second);
+      }
+      samples[std::make_pair(stack, event.name.str())]++;
+      start = std::min(start, event.time_millis);
+   }
+
+   for (const auto &entry : samples) {
+      ProtoWriter label;
+      label.uint(1, string("thread"));
+      label.uint(2, string(entry.first.second));
+      message.out.clear();
+      message.packed(1, entry.first.first);
+      message.packed(2, std::vector<uint64_t>(1, entry.second));
+      message.bytes(3, label.out);
+      profile.bytes(2, message.out);
+   }
+
+   message.out.clear();
+   message.uint(1, string("samples"));
+   message.uint(2, string("count"));
+   profile.bytes(1, message.out);
+   if (!events.empty()) {
+      profile.uint(9, start * 1000 * 1000);
+   }
+   for (const std::string *value : string_table) {
+      profile.bytes(6, *value);
+   }
+
+   fwrite(profile.out.data(), 1, profile.out.size(), out);
+}
+
+static void usage()
+{
+   fprintf(stderr,
+      "Usage: astack-reader [options] file...\n"
+      "\n"
+      "Reads binary snapshot streams, spool segments and ring files of the AStack agent.\n"
+      "\n"
+      "  --format=text|folded|pprof|json  output format (default text)\n"
+      "  --from=<millis>                  earliest time, in epoch milliseconds\n"
+      "  --to=<millis>                    latest time, in epoch milliseconds\n"
+      "  --thread=<name>                  only threads with this name\n"
+      "  --tid=<tid>                      only threads with this kernel thread ID\n"
+      "  --class=<prefix>,...             only threads with a frame of a class with a prefix\n"
+      "  --method=<name>,...              only threads with a frame of a method\n"
+      "  --threads                        folded stacks include the thread name\n");
+}
+
+static bool parseArgument(const char *arg)
+{
+   const char *equals = strchr(arg, '=');
+   std::string name = equals ? std::string(arg, equals - arg) : arg;
+   const char *value = equals ? equals + 1 : nullptr;
+
+   if (name == "--threads") {
+      options.thread_names = true;
+      return value == nullptr;
+   }
+   if (value == nullptr) {
+      return false;
+   }
+   if (name == "--format") {
+      if (strcmp(value, "text") == 0) {
+         options.format = OUTPUT_TEXT;
+      }
+      else if (strcmp(value, "folded") == 0) {
+         options.format = OUTPUT_FOLDED;
+      }
+      else if (strcmp(value, "pprof") == 0) {
+         options.format = OUTPUT_PPROF;
+      }
+      else if (strcmp(value, "json") == 0) {
+         options.format = OUTPUT_JSON;
+      }
+      else {
+         return false;
+      }
+      return true;
+   }
+   if (name == "--from") {
+      return parseLong(value, &options.from);
+   }
+   if (name == "--to") {
+      return parseLong(value, &options.to);
+   }
+   if (name == "--thread") {
+      options.thread = value;
+      return true;
+   }
+   if (name == "--tid") {
+      return parseLong(value, &options.tid) && (options.tid >= 0);
+   }
+   if (name == "--class") {
+      splitList(value, &options.class_prefixes);
+      return true;
+   }
+   if (name == "--method") {
+      splitList(value, &options.methods);
+      return true;
+   }
+   return false;
+}
+
+int main(int argc, char **argv)
+{
+   int first_file = 1;
+   for (; (first_file < argc) && (strncmp(argv[first_file], "--", 2) == 0); first_file++) {
+      if (!parseArgument(argv[first_file])) {
+         fprintf(stderr, "ERROR: invalid argument: %s\n", argv[first_file]);
+         usage();
+         return 1;
+      }
+   }
+   if (first_file == argc) {
+      usage();
+      return 1;
+   }
+
+   for (int i = first_file; i < argc; i++) {
+      if (!readFile(argv[i])) {
+         return 1;
+      }
+   }
+
+   // merge the files in time order, keeping the order of each snapshot
+   std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+      return a.time_millis < b.time_millis;
+   });
+
+   switch (options.format) {
+      case OUTPUT_TEXT:
+         writeText(stdout);
+         break;
+      case OUTPUT_FOLDED:
+         writeFolded(stdout);
+         break;
+      case OUTPUT_PPROF:
+         writePprof(stdout);
+         break;
+      case OUTPUT_JSON:
+         writeJson(stdout);
+         break;
+   }
+   return 0;
+}
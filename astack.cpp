@@ -12,21 +12,44 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
+#include <regex.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <jvmti.h>
 
+#include "astack_format.h"
+
 struct AsyncCallFrame {
    jint lineno;
    jmethodID method;
@@ -42,27 +65,580 @@ extern "C"
 void AsyncGetCallTrace(AsyncCallTrace *trace, jint depth, void *ucontext)
 __attribute__ ((weak));
 
+static const jint NATIVE_METHOD_LINENO = -3; // value used by JVM
+static const int SIGSTACK = SIGPWR; // arbitrary unused signal
+static const int MAX_FRAMES = 128;
+static const int MAX_CONTEXT_LABEL = 64;
+static const size_t MAX_CONTEXT_LABELS = 4096;
+static const int MAX_REQUEST_ARGS = 16;
+static const jlong REQUEST_TIMEOUT_MILLIS = 100;
+static const jlong WATCHDOG_TICK_NANOS = 10 * 1000 * 1000;
+static const int WATCHDOG_WHEEL_SLOTS = 256;
+static const size_t MAX_OVERRUNS = 64;
+static const size_t MAX_OVERRUN_SAMPLES = 64;
+static const size_t MAX_PREDICATES = 16;
+static const uint32_t SPOOL_INDEX_CAPACITY = 4096;
+static const size_t GASP_METHOD_SLOTS = 64 * 1024;
+static const int MAX_GASPS = 16;
+static const int LOCK_HISTOGRAM_BUCKETS = 6; // decades from under 1 ms to 10 s and longer
+static const size_t MAX_EXCEPTION_SITE_STACKS = 8;
+static const jlong EXCEPTION_RATE_NANOS = 60LL * 1000 * 1000 * 1000; // time constant of the throw rates
+static const jlong GC_PAUSE_SLOTS = 1024;
+static const char *const DEFAULT_POOL_PATTERN = "[-_ #]*[0-9]+$";
+
+struct ThreadContext {
+   jlong id;
+   char label[MAX_CONTEXT_LABEL];
+};
+
 struct ThreadTag {
    JNIEnv *jni;
    pthread_t thread_id;
+
+   // context set from Java by the owning thread. The signal handler runs
+   // on the same thread, so the writer fills the inactive slot and then
+   // flips the index, and the handler never sees a partial update.
+   ThreadContext context[2];
+   volatile sig_atomic_t context_index;
+
+   jthread thread; // global reference
+   pid_t tid;
+   jlong java_id;
+   jlong serial; // unique for the lifetime of the agent
+   bool daemon;
+   jint priority; // at thread start
+
+   // deadline watchdog state, guarded by x_watchdog_lock
+   bool in_wheel;
+   int wheel_slot;
+   ThreadTag *wheel_next;
+   ThreadTag *wheel_prev;
+   jlong deadline;
+   jlong timeout_millis;
+   jlong armed_millis;
+   jlong overrun_id;
+
+   // stuck thread detection state, guarded by x_trace_lock
+   uint64_t fingerprint;
+   jint last_state;
+   jlong unchanged_since;
+   jlong unchanged_cpu_time;
+   jlong last_cpu_time;
+   bool stuck_reported;
+
+   // only used by the owning thread, from its event callbacks
+   jlong contended_since; // monotonic nanoseconds, zero if not blocked
+   jlong waiting_since;   // monotonic nanoseconds, zero if not in Object.wait
 };
 
-static const jint NATIVE_METHOD_LINENO = -3; // value used by JVM
-static const int SIGSTACK = SIGPWR; // arbitrary unused signal
-static const int MAX_FRAMES = 128;
+struct StackTrace {
+   jint num_frames;
+   AsyncCallFrame frames[MAX_FRAMES];
+   ThreadContext context;
+};
+
+struct OverrunSample {
+   jlong offset; // nanoseconds after the deadline
+   ThreadContext context;
+   std::vector<AsyncCallFrame> frames;
+};
+
+struct Overrun {
+   jlong id;
+   std::string thread_name;
+   pid_t tid;
+   jlong armed_millis;
+   jlong timeout_millis;
+   jlong deadline;
+   jlong finished; // zero while the thread is still overrunning
+   std::vector<OverrunSample> samples;
+};
+
+struct ThreadSnapshot {
+   jlong serial;
+   std::string name;
+   bool daemon;
+   jint priority;
+   jint state;
+   pid_t tid;
+   jlong cpu_time; // nanoseconds, zero if unavailable
+   ThreadContext context;
+   std::vector<AsyncCallFrame> frames;
+};
+
+struct Snapshot {
+   jlong id;
+   jlong time_millis;
+   std::vector<ThreadSnapshot> threads;
+   jlong gc_pauses = 0; // overlapping the capture
+   jlong gc_nanos = 0;
+};
+
+enum SnapshotFormat {
+   FORMAT_TEXT = 0,
+   FORMAT_FOLDED = 1,
+   FORMAT_BINARY = 2,
+};
+
+struct MethodInfo {
+   std::string class_name;
+   std::string method_name;
+   std::string source_name; // empty if unknown
+   std::vector<jvmtiLineNumberEntry> line_numbers;
+   int fold_rule; // index into fold_rules, or -1
+};
+
+struct FoldRule {
+   std::string prefix;
+   std::string label;
+   bool drop;
+};
+
+// frame as written to the output, after applying the fold rules
+struct EmittedFrame {
+   jmethodID method; // null for a run of folded frames
+   jint lineno;      // fold rule index for a run of folded frames
+   jint count;       // number of frames in a folded run
+};
+
+// encodes records of astack_format.h, flushing to out (if any) as it goes
+struct BinaryWriter {
+   FILE *out = nullptr;
+   std::vector<uint8_t> buffer;
+   size_t record_start = 0;
+   std::unordered_set<jmethodID> methods;
+
+   void u8(uint8_t value);
+   void u16(uint16_t value);
+   void u32(uint32_t value);
+   void u64(uint64_t value);
+   void str(const char *value);
+   void beginRecord(uint8_t type);
+   void endRecord();
+   void flush(bool force);
+};
+
+// encodes protocol buffer fields, for pprof profiles
+struct ProtoWriter {
+   std::string out;
+
+   void varint(uint64_t value);
+   void key(int field, int wire_type);
+   void uint(int field, uint64_t value);
+   void bytes(int field, const std::string &value);
+   void packed(int field, const std::vector<uint64_t> &values);
+};
+
+// spool segment being written, mapped into memory so that everything
+// written survives a crash of the process
+struct SpoolSegment {
+   int fd = -1;
+   uint8_t *map = nullptr;
+   uint32_t sequence = 0;
+   uint32_t data_end = 0;
+   uint32_t dictionary_start = 0;
+   uint32_t index_count = 0;
+   jlong last_second = -1;
+   BinaryWriter dictionary; // method and stack records of the segment
+   std::unordered_map<uint64_t, uint32_t> stacks; // stack IDs by frame hash, probed on collision
+   std::vector<std::vector<AsyncCallFrame>> stack_frames; // frames of each stack ID
+   std::unordered_map<pid_t, std::string> thread_names;
+   std::unordered_map<jlong, std::string> context_labels; // last label written for each context id
+   bool dropped = false;
+};
+
+// ring file for consumers in other processes, only written by the sampler
+struct RingState {
+   uint8_t *map = nullptr;
+   uint64_t capacity = 0;
+   uint64_t head = 0;
+   uint64_t tail = 0;
+   uint64_t dictionary = 0;
+   BinaryWriter batch; // records of one sample
+   std::unordered_set<jmethodID> methods;
+   std::unordered_map<pid_t, std::string> thread_names;
+   std::unordered_map<jlong, std::string> context_labels; // last label written for each context id
+};
+
+// writes records to a preallocated buffer, for captures that must not
+// allocate memory
+struct FixedWriter {
+   uint8_t *data = nullptr;
+   size_t capacity = 0;
+   size_t size = 0;
+   size_t record_start = 0;
+   bool overflow = false;
+
+   void put(const void *value, size_t length);
+   void u8(uint8_t value);
+   void u16(uint16_t value);
+   void u32(uint32_t value);
+   void u64(uint64_t value);
+   void str(const char *value);
+   void beginRecord(uint8_t type);
+   void endRecord();
+};
+
+// node of the call tree merged across threads, children keyed by frame
+struct TreeNode {
+   EmittedFrame frame = {};
+   jlong count = 0;
+   std::map<const char *, jlong> states;
+   std::map<std::pair<jmethodID, jint>, int> children;
+};
+
+// matches frames by class name prefix and method name
+struct FramePredicate {
+   std::vector<std::string> class_prefixes;
+   std::vector<std::string> methods;
+   std::unordered_map<jmethodID, bool> matches;
+};
+
+// stack interned by the profile history, keyed by its frames, whether
+// the thread was runnable and its context
+struct InternedStack {
+   uint64_t hash;
+   bool runnable;
+   ThreadContext context;
+   std::vector<AsyncCallFrame> frames;
+};
+
+// sample counts by stack ID for one time bucket of the profile history
+struct ProfileBucket {
+   jlong start_millis = -1; // -1 if unused
+   jlong samples = 0;
+   jlong dropped = 0; // samples of stacks that did not fit the stack table
+   jlong gc_pauses = 0;
+   jlong gc_nanos = 0;
+   jlong skipped = 0; // ticks not sampled because of a GC pause
+   std::unordered_map<uint32_t, jlong> counts;
+};
+
+// stop-the-world GC pause, from the GarbageCollectionStart to the
+// GarbageCollectionFinish event
+struct GcPause {
+   jlong start_micros; // wall clock
+   jlong nanos;
+};
+
+// one periodic sample of a thread in its timeline
+struct TimelineEntry {
+   jlong time_millis;
+   jint state;
+   uint32_t stack_id; // UINT32_MAX if the stack table was full
+};
+
+// most recent samples of a thread, in a ring of at most timeline entries
+struct Timeline {
+   std::string name;
+   std::vector<TimelineEntry> entries;
+   size_t next = 0; // oldest entry once the ring is full
+};
+
+// blocked time of one lock class and stack, and the durations of the
+// captured events
+struct LockSite {
+   std::string lock_class;
+   std::vector<AsyncCallFrame> frames;
+   jlong nanos;
+   jlong events;
+   jlong timed_out;
+   jlong histogram[LOCK_HISTOGRAM_BUCKETS];
+};
+
+// blocked time by lock class and stack, guarded by x_lock_profile_lock
+// except for the atomic totals of all events, captured or not
+struct LockProfile {
+   std::vector<LockSite> sites;
+   std::unordered_map<uint64_t, uint32_t> ids; // by hash of the frames and class
+   jlong dropped = 0; // events of sites that did not fit
+   std::atomic<jlong> pending{0}; // short events not yet sampled, in nanoseconds
+   std::atomic<jlong> events{0};
+   std::atomic<jlong> nanos{0};
+   std::atomic<jlong> timed_out{0};
+   std::atomic<jlong> histogram[LOCK_HISTOGRAM_BUCKETS];
+};
+
+// sampled allocations of one class from one stack, with the totals
+// estimated from the samples
+struct AllocSite {
+   uint32_t stack_id;
+   std::string class_name;
+   jlong samples;
+   jlong objects;
+   jlong bytes;
+};
+
+// sampled stack that threw at an exception site
+struct ExceptionStack {
+   std::vector<AsyncCallFrame> frames;
+   jlong samples;
+};
+
+// throws of one exception class at one location, with an exponentially
+// decaying rate in throws per second
+struct ExceptionSite {
+   uint32_t class_id;
+   jmethodID method;
+   jlocation location;
+   jlong thrown;
+   double rate;
+   jlong rate_nanos; // monotonic time the rate was last decayed to
+   std::vector<ExceptionStack> stacks;
+};
+
+// stack of a differential profile, with its samples in both windows
+struct DeltaStack {
+   ThreadContext context = {};
+   std::vector<AsyncCallFrame> frames;
+   jlong before = 0;
+   jlong after = 0;
+};
+
+struct Request {
+   char buffer[4096];
+   const char *command;
+   int arg_count;
+   const char *keys[MAX_REQUEST_ARGS];
+   const char *values[MAX_REQUEST_ARGS];
+};
 
 static int port;
+static std::string socket_dir;
+static std::string socket_path; // set before the listener starts
+static jlong deadline_interval = 100;
+static jlong sample_interval;
+static jlong stuck_threshold = 10 * 1000;
+static bool stuck_log;
+static bool cpu_time_enabled;
+static std::vector<regex_t> pool_patterns;
+static std::vector<FoldRule> fold_rules;
+static jlong max_snapshots = 8;
+static jlong max_threads;
+static jlong bucket_seconds = 10;
+static jlong history_seconds = 60 * 60;
+static jlong max_stacks = 64 * 1024;
+static jlong timeline_samples;
+static bool contention;
+static jlong contention_threshold = 10 * 1000; // microseconds
+static bool waits;
+static jlong wait_threshold = 10 * 1000; // microseconds
+static jlong alloc_interval; // bytes
+static bool exceptions;
+static bool gc;
+static jlong exception_samples = 100; // stacks per second
+static std::string spool_dir;
+static jlong spool_size = 16 * 1024 * 1024;
+static jlong spool_segments = 8;
+static std::string ring_file;
+static jlong ring_size = 16 * 1024 * 1024;
+static std::string gasp_file;
+static jlong gasp_size = 16 * 1024 * 1024;
+static bool gasp_signal;
+static jlong max_bytes;
+static jvmtiEnv *agent_jvmti;
 
 static AsyncCallTrace x_trace;
 static AsyncCallFrame x_frames[MAX_FRAMES];
+static ThreadTag *x_trace_tag;
+static ThreadContext x_context;
 static std::atomic_flag x_trace_running;
 static jrawMonitorID x_trace_lock;
 
+// thread registry, guarded by x_trace_lock
+static std::unordered_map<jlong, ThreadTag *> x_threads_by_java_id;
+static std::unordered_map<pid_t, ThreadTag *> x_threads_by_tid;
+static std::unordered_multimap<std::string, ThreadTag *> x_threads_by_name;
+static std::unordered_map<ThreadTag *, std::string> x_thread_names;
+
+// lock order: x_watchdog_lock before x_trace_lock
+static jrawMonitorID x_watchdog_lock;
+static ThreadTag *x_wheel[WATCHDOG_WHEEL_SLOTS];
+static jlong x_wheel_tick;
+static int x_wheel_count;
+static std::deque<Overrun> x_overruns;
+static jlong x_last_overrun_id;
+
+static std::atomic<jlong> x_last_snapshot_id;
+static std::atomic<jlong> x_last_thread_serial;
+static jmethodID x_thread_get_id;
+
+static jrawMonitorID x_snapshot_lock;
+static std::deque<std::shared_ptr<const Snapshot>> x_snapshots;
+
+static jrawMonitorID x_method_lock;
+static std::unordered_map<jmethodID, MethodInfo> x_methods;
+
+static std::unordered_map<std::string, FramePredicate> x_predicates;
+
+static jrawMonitorID x_spool_lock;
+static SpoolSegment x_spool;
+
+static RingState x_ring;
+
+static jrawMonitorID x_gasp_lock;
+static FixedWriter x_gasp_writer;
+static jmethodID x_gasp_methods[GASP_METHOD_SLOTS];
+static int x_gasp_fd = -1;
+static int x_gasp_count;
+static jlong x_last_gasp;
+static sem_t x_gasp_semaphore;
+static struct sigaction x_previous_sigterm;
+
+static jrawMonitorID x_profile_lock;
+static std::vector<InternedStack> x_stacks;
+static std::unordered_map<uint64_t, uint32_t> x_stack_ids;
+static std::vector<ProfileBucket> x_buckets;
+static bool x_stacks_reclaimable;
+static jlong x_stack_rebuilds; // stack IDs change on every rebuild
+static std::unordered_map<pid_t, Timeline> x_timelines;
+static std::vector<AllocSite> x_alloc_sites;
+static std::unordered_map<uint64_t, uint32_t> x_alloc_ids; // by hash of the stack ID and class
+static jlong x_alloc_dropped; // samples of stacks that did not fit the stack table
+
+static jrawMonitorID x_lock_profile_lock;
+static LockProfile x_contention;
+static LockProfile x_waits;
+
+static jrawMonitorID x_exception_lock;
+static std::vector<std::string> x_exception_classes; // by class ID, tagged on the classes
+static std::unordered_map<std::string, uint32_t> x_exception_class_ids;
+static std::vector<ExceptionSite> x_exception_sites;
+static std::unordered_map<uint64_t, uint32_t> x_exception_ids; // by hash of the class, method and location
+static jlong x_exceptions_thrown;
+static jlong x_exceptions_sampled;
+static jlong x_exceptions_limited; // stacks not sampled because of the rate limit
+static jlong x_exceptions_dropped; // throws of sites that did not fit
+static double x_exception_tokens;
+static jlong x_exception_refill_nanos;
+static std::atomic<bool> x_exceptions_enabled;
+
+// ring of GC pauses, written only by the GC events. A slot is being
+// overwritten while x_gc_writing is ahead of x_gc_count.
+static GcPause x_gc_pauses[GC_PAUSE_SLOTS];
+static std::atomic<jlong> x_gc_count;
+static std::atomic<jlong> x_gc_writing;
+static std::atomic<jlong> x_gc_start_nanos; // zero if no GC is running
+static jlong x_gc_start_micros;
+static jlong x_gc_drained; // pauses added to the buckets, guarded by x_profile_lock
+
 static bool ok(jvmtiError err)
 {
    return err == JVMTI_ERROR_NONE;
 }
 
+static jlong monotonicNanos()
+{
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000LL * 1000 * 1000) + ts.tv_nsec;
+}
+
+static jlong currentTimeMillis()
+{
+   timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (ts.tv_sec * 1000LL) + (ts.tv_nsec / (1000 * 1000));
+}
+
+static jlong currentTimeMicros()
+{
+   timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (ts.tv_sec * 1000LL * 1000) + (ts.tv_nsec / 1000);
+}
+
+static void formatTime(jlong millis, char *buffer, size_t size)
+{
+   time_t seconds = millis / 1000;
+   tm utc;
+   gmtime_r(&seconds, &utc);
+   size_t len = strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &utc);
+   snprintf(buffer + len, size - len, ".%03dZ", (int) (millis % 1000));
+}
+
+static bool parseLong(const char *value, jlong *result)
+{
+   char *end;
+   errno = 0;
+   long long parsed = strtoll(value, &end, 10);
+   if ((errno != 0) || (end == value) || (*end != '\0')) {
+      return false;
+   }
+   *result = parsed;
+   return true;
+}
+
+static bool parseBool(const char *value, bool *result)
+{
+   if (strcmp(value, "true") == 0) {
+      *result = true;
+      return true;
+   }
+   if (strcmp(value, "false") == 0) {
+      *result = false;
+      return true;
+   }
+   return false;
+}
+
+static const char *requestArg(const Request *request, const char *key)
+{
+   for (int i = 0; i < request->arg_count; i++) {
+      if (strcmp(request->keys[i], key) == 0) {
+         return request->values[i];
+      }
+   }
+   return nullptr;
+}
+
+static bool requestFlag(const Request *request, const char *key)
+{
+   const char *value = requestArg(request, key);
+   bool result = false;
+   return (value != nullptr) && ((value[0] == '\0') || (parseBool(value, &result) && result));
+}
+
+static uint64_t hashFrames(const AsyncCallFrame *frames, jint num_frames, jint state)
+{
+   // FNV-1a over the frames and the thread state
+   uint64_t hash = 14695981039346656037ULL;
+   auto mix = [&hash](uint64_t value) {
+      for (int i = 0; i < 8; i++) {
+         hash ^= (value >> (i * 8)) & 0xFF;
+         hash *= 1099511628211ULL;
+      }
+   };
+
+   mix(state);
+   mix(num_frames);
+   for (int i = 0; i < num_frames; i++) {
+      mix((uint64_t) frames[i].method);
+      mix(frames[i].lineno);
+   }
+   return hash;
+}
+
+// Like hashFrames, but without the bytecode indexes, which change on
+// nearly every sample of a thread running in a loop.
+static uint64_t hashMethods(const AsyncCallFrame *frames, jint num_frames, jint state)
+{
+   uint64_t hash = 14695981039346656037ULL;
+   auto mix = [&hash](uint64_t value) {
+      for (int i = 0; i < 8; i++) {
+         hash ^= (value >> (i * 8)) & 0xFF;
+         hash *= 1099511628211ULL;
+      }
+   };
+
+   mix(state);
+   mix(num_frames);
+   for (int i = 0; i < num_frames; i++) {
+      mix((uint64_t) frames[i].method);
+   }
+   return hash;
+}
+
 static void fixClassSignature(char *s)
 {
    size_t len = strlen(s);
@@ -81,18 +657,76 @@ static void fixClassSignature(char *s)
    }
 }
 
-static jint getLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation target)
+static const MethodInfo *lookupMethod(jvmtiEnv *jvmti, JNIEnv *jni, jmethodID method)
 {
-   if (target < 0) {
-      return target;
+   jvmti->RawMonitorEnter(x_method_lock);
+
+   auto found = x_methods.find(method);
+   if (found != x_methods.end()) {
+      jvmti->RawMonitorExit(x_method_lock);
+      return &found->second;
+   }
+
+   // entries are never removed, so the pointer stays valid after unlocking
+   MethodInfo *info = &x_methods[method];
+   info->class_name = "Unknown";
+   info->method_name = "Unknown";
+
+   char *method_name;
+   if (ok(jvmti->GetMethodName(method, &method_name, nullptr, nullptr))) {
+      info->method_name = method_name;
+      jvmti->Deallocate((unsigned char *) method_name);
+   }
+
+   jclass clazz;
+   if (ok(jvmti->GetMethodDeclaringClass(method, &clazz))) {
+      char *class_name;
+      if (ok(jvmti->GetClassSignature(clazz, &class_name, nullptr))) {
+         fixClassSignature(class_name);
+         info->class_name = class_name;
+         jvmti->Deallocate((unsigned char *) class_name);
+      }
+      char *source_name;
+      if (ok(jvmti->GetSourceFileName(clazz, &source_name))) {
+         info->source_name = source_name;
+         jvmti->Deallocate((unsigned char *) source_name);
+      }
+      jni->DeleteLocalRef(clazz);
    }
 
    jint count;
    jvmtiLineNumberEntry *table;
-   if (!ok(jvmti->GetLineNumberTable(method, &count, &table))) {
-      return -1;
+   if (ok(jvmti->GetLineNumberTable(method, &count, &table))) {
+      info->line_numbers.assign(table, table + count);
+      jvmti->Deallocate((unsigned char *) table);
+   }
+
+   // the first matching rule wins, and is then a lookup per frame
+   info->fold_rule = -1;
+   for (size_t i = 0; i < fold_rules.size(); i++) {
+      if (info->class_name.compare(0, fold_rules[i].prefix.size(), fold_rules[i].prefix) == 0) {
+         info->fold_rule = i;
+         break;
+      }
+   }
+
+   jvmti->RawMonitorExit(x_method_lock);
+   return info;
+}
+
+static jint lineNumberAt(const jvmtiLineNumberEntry *table, jint count, jlocation target);
+
+static jint getLineNumber(const MethodInfo *info, jlocation target)
+{
+   if (target < 0) {
+      return target;
    }
 
+   return lineNumberAt(info->line_numbers.data(), info->line_numbers.size(), target);
+}
+
+static jint lineNumberAt(const jvmtiLineNumberEntry *table, jint count, jlocation target)
+{
    jint line_number = -1;
    if (count == 1) {
       line_number = table[0].line_number;
@@ -111,7 +745,6 @@ static jint getLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation target)
       }
    }
 
-   jvmti->Deallocate((unsigned char *) table);
    return line_number;
 }
 
@@ -153,90 +786,126 @@ static const char *threadStateEnum(jint state)
    return "NEW";
 }
 
-static void printCallFrame(jvmtiEnv *jvmti, JNIEnv *jni, jmethodID method, jint lineno, FILE *out)
+static void printFrameText(jvmtiEnv *jvmti, JNIEnv *jni, jmethodID method, jint lineno, FILE *out)
 {
-   char *method_name;
-   if (!ok(jvmti->GetMethodName(method, &method_name, nullptr, nullptr))) {
-      method_name = nullptr;
-   }
-
-   jclass clazz;
-   char *class_name = nullptr;
-   char *source_name = nullptr;
-   if (ok(jvmti->GetMethodDeclaringClass(method, &clazz))) {
-      if (ok(jvmti->GetClassSignature(clazz, &class_name, nullptr))) {
-         fixClassSignature(class_name);
-      }
-      else {
-         class_name = nullptr;
-      }
-      if (!ok(jvmti->GetSourceFileName(clazz, &source_name))) {
-         source_name = nullptr;
-      }
-      jni->DeleteLocalRef(clazz);
-   }
+   const MethodInfo *info = lookupMethod(jvmti, jni, method);
+   jint line_number = getLineNumber(info, lineno);
 
-   jint line_number = getLineNumber(jvmti, method, lineno);
-
-   const char *class_text = class_name ?: "Unknown";
-   const char *method_text = method_name ?: "Unknown";
+   const char *class_text = info->class_name.c_str();
+   const char *method_text = info->method_name.c_str();
+   const char *source_name = info->source_name.c_str();
 
    if (line_number == NATIVE_METHOD_LINENO) {
-      fprintf(out, "\tat %s.%s(Native Method)\n", class_text, method_text);
+      fprintf(out, "%s.%s(Native Method)", class_text, method_text);
    }
-   else if (source_name == nullptr) {
-      fprintf(out, "\tat %s.%s(Unknown Source)\n", class_text, method_text);
+   else if (info->source_name.empty()) {
+      fprintf(out, "%s.%s(Unknown Source)", class_text, method_text);
    }
    else if (line_number <= 0) {
-      fprintf(out, "\tat %s.%s(%s)\n", class_text, method_text, source_name);
+      fprintf(out, "%s.%s(%s)", class_text, method_text, source_name);
    }
    else {
-      fprintf(out, "\tat %s.%s(%s:%d)\n", class_text, method_text, source_name, line_number);
+      fprintf(out, "%s.%s(%s:%d)", class_text, method_text, source_name, line_number);
    }
-
-   jvmti->Deallocate((unsigned char *) method_name);
-   jvmti->Deallocate((unsigned char *) class_name);
-   jvmti->Deallocate((unsigned char *) source_name);
 }
 
-static void printThreadDump(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, FILE *out)
+static void printCallFrame(jvmtiEnv *jvmti, JNIEnv *jni, jmethodID method, jint lineno, FILE *out)
 {
-   jint state;
-   jvmtiThreadInfo info;
-   if (ok(jvmti->GetThreadState(thread, &state)) &&
-         ok(jvmti->GetThreadInfo(thread, &info))) {
-      fprintf(out,
-         "\"%s\"%s prio=%d\n"
-         "  java.lang.Thread.Stage: %s\n",
-         info.name,
-         info.is_daemon ? " daemon" : "",
-         info.priority,
-         threadStateEnum(state));
+   fprintf(out, "\tat ");
+   printFrameText(jvmti, jni, method, lineno, out);
+   fprintf(out, "\n");
+}
 
-      jvmti->Deallocate((unsigned char *) info.name);
-      jni->DeleteLocalRef(info.thread_group);
-      jni->DeleteLocalRef(info.context_class_loader);
+static void printContext(const ThreadContext *context, FILE *out)
+{
+   if ((context->id == 0) && (context->label[0] == '\0')) {
+      return;
    }
 
-   for (int i = 0; i < x_trace.num_frames; i++) {
-      AsyncCallFrame *frame = &(x_trace.frames[i]);
-      printCallFrame(jvmti, jni, frame->method, frame->lineno, out);
+   fprintf(out, "  astack.context:");
+   if (context->id != 0) {
+      fprintf(out, " id=%lld", (long long) context->id);
+   }
+   if (context->label[0] != '\0') {
+      fprintf(out, " label=%s", context->label);
    }
    fprintf(out, "\n");
 }
 
-static void dumpThread(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, FILE *out)
+// apply the fold rules to frames, ordered from the top of the stack
+static void foldFrames(jvmtiEnv *jvmti, JNIEnv *jni, const AsyncCallFrame *frames, jint num_frames, std::vector<EmittedFrame> *emitted)
 {
-   jvmti->RawMonitorEnter(x_trace_lock);
+   emitted->clear();
+   for (int i = 0; i < num_frames; i++) {
+      int rule = fold_rules.empty() ? -1 : lookupMethod(jvmti, jni, frames[i].method)->fold_rule;
+      if (rule < 0) {
+         emitted->push_back(EmittedFrame { frames[i].method, frames[i].lineno, 1 });
+      }
+      else if (fold_rules[rule].drop) {
+         continue;
+      }
+      else if (!emitted->empty() && (emitted->back().method == nullptr) && (emitted->back().lineno == rule)) {
+         emitted->back().count++;
+      }
+      else {
+         emitted->push_back(EmittedFrame { nullptr, rule, 1 });
+      }
+   }
+}
 
-   ThreadTag *tag;
-   if (!ok(jvmti->GetTag(thread, (jlong *) &tag)) || (tag == nullptr)) {
-      jvmti->RawMonitorExit(x_trace_lock);
-      return;
+static void printEmittedFrameText(jvmtiEnv *jvmti, JNIEnv *jni, const EmittedFrame &frame, FILE *out)
+{
+   if (frame.method != nullptr) {
+      printFrameText(jvmti, jni, frame.method, frame.lineno, out);
+   }
+   else {
+      fprintf(out, "[%s]", fold_rules[frame.lineno].label.c_str());
+   }
+}
+
+static void printFrames(jvmtiEnv *jvmti, JNIEnv *jni, const AsyncCallFrame *frames, jint num_frames, FILE *out)
+{
+   std::vector<EmittedFrame> emitted;
+   foldFrames(jvmti, jni, frames, num_frames, &emitted);
+
+   for (const EmittedFrame &frame : emitted) {
+      if (frame.method != nullptr) {
+         printCallFrame(jvmti, jni, frame.method, frame.lineno, out);
+      }
+      else {
+         fprintf(out, "\t... %d frames in %s\n", frame.count, fold_rules[frame.lineno].label.c_str());
+      }
    }
+}
+
+static void printThreadHeader(const ThreadSnapshot *thread, FILE *out)
+{
+   fprintf(out,
+      "\"%s\"%s prio=%d\n"
+      "  java.lang.Thread.Stage: %s\n",
+      thread->name.c_str(),
+      thread->daemon ? " daemon" : "",
+      thread->priority,
+      threadStateEnum(thread->state));
+}
+
+static void printThreadDump(jvmtiEnv *jvmti, JNIEnv *jni, const ThreadSnapshot *thread, FILE *out)
+{
+   printThreadHeader(thread, out);
+   printContext(&thread->context, out);
+   printFrames(jvmti, jni, thread->frames.data(), thread->frames.size(), out);
+   fprintf(out, "\n");
+}
+
+// The caller must keep the tag alive, either by holding x_trace_lock
+// (which onThreadEnd needs before freeing it) or by being its thread.
+static bool captureTrace(jvmtiEnv *jvmti, ThreadTag *tag, StackTrace *trace)
+{
+   jvmti->RawMonitorEnter(x_trace_lock);
 
    x_trace.frames = x_frames;
    x_trace.jni = tag->jni;
+   x_trace_tag = tag;
    x_trace_running.test_and_set();
 
    pthread_kill(tag->thread_id, SIGSTACK);
@@ -250,17 +919,84 @@ static void dumpThread(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, FILE *out)
       }
    }
 
-   jvmti->RawMonitorExit(x_trace_lock);
-
    if (done) {
-      printThreadDump(jvmti, jni, thread, out);
+      trace->num_frames = x_trace.num_frames;
+      if (trace->num_frames > 0) {
+         memcpy(trace->frames, x_frames, trace->num_frames * sizeof(AsyncCallFrame));
+      }
+      trace->context = x_context;
    }
-   else {
+
+   jvmti->RawMonitorExit(x_trace_lock);
+
+   if (!done) {
       fprintf(stderr, "WARNING: AStack trace did not complete\n");
    }
+   return done;
+}
+
+// Capture the stack of the current thread from one of its event
+// callbacks. It is not running Java code there, so AsyncGetCallTrace
+// walks from its last Java frame and needs no signal context.
+static void captureOwnTrace(JNIEnv *jni, ThreadTag *tag, StackTrace *trace)
+{
+   AsyncCallTrace async;
+   async.jni = jni;
+   async.frames = trace->frames;
+   AsyncGetCallTrace(&async, MAX_FRAMES, nullptr);
+   trace->num_frames = std::max(async.num_frames, 0);
+   trace->context = tag->context[tag->context_index];
+}
+
+// must be called with x_trace_lock held
+static void unregisterName(ThreadTag *tag)
+{
+   auto name = x_thread_names.find(tag);
+   if (name != x_thread_names.end()) {
+      auto range = x_threads_by_name.equal_range(name->second);
+      for (auto entry = range.first; entry != range.second; ++entry) {
+         if (entry->second == tag) {
+            x_threads_by_name.erase(entry);
+            break;
+         }
+      }
+      x_thread_names.erase(name);
+   }
+}
+
+// must be called with x_trace_lock held
+static void registerThread(ThreadTag *tag, const char *name)
+{
+   x_threads_by_java_id[tag->java_id] = tag;
+   x_threads_by_tid[tag->tid] = tag;
+   x_threads_by_name.emplace(name, tag);
+   x_thread_names[tag] = name;
+}
+
+// must be called with x_trace_lock held
+static void unregisterThread(ThreadTag *tag)
+{
+   x_threads_by_java_id.erase(tag->java_id);
+   x_threads_by_tid.erase(tag->tid);
+   unregisterName(tag);
+}
+
+// Index a thread under the name it had when it was last sampled or
+// dumped. Must be called with x_trace_lock held.
+static void renameThread(ThreadTag *tag, const char *name)
+{
+   auto found = x_thread_names.find(tag);
+   if ((found != x_thread_names.end()) && (found->second == name)) {
+      return;
+   }
+   unregisterName(tag);
+   x_threads_by_name.emplace(name, tag);
+   x_thread_names[tag] = name;
 }
 
-static void handleClient(jvmtiEnv *jvmti, JNIEnv *jni, FILE *out)
+// Reindex every thread under its current name. The names are read
+// without holding x_trace_lock, which is only taken to update each one.
+static void refreshThreadNames(jvmtiEnv *jvmti, JNIEnv *jni)
 {
    jint count;
    jthread *threads;
@@ -272,192 +1008,4903 @@ static void handleClient(jvmtiEnv *jvmti, JNIEnv *jni, FILE *out)
 
    for (int i = 0; i < count; i++) {
       auto thread = threads[i];
-      dumpThread(jvmti, jni, thread, out);
+      jvmtiThreadInfo info;
+      if (ok(jvmti->GetThreadInfo(thread, &info))) {
+         jvmti->RawMonitorEnter(x_trace_lock);
+         ThreadTag *tag;
+         if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+            renameThread(tag, info.name);
+         }
+         jvmti->RawMonitorExit(x_trace_lock);
+         jvmti->Deallocate((unsigned char *) info.name);
+         jni->DeleteLocalRef(info.thread_group);
+         jni->DeleteLocalRef(info.context_class_loader);
+      }
       jni->DeleteLocalRef(thread);
    }
 
    jvmti->Deallocate((unsigned char *) threads);
 }
 
-
+// Find a thread by the name it had when it was last sampled or dumped.
+// Must be called with x_trace_lock held.
+static ThreadTag *findThreadByName(const char *name)
+{
+   auto found = x_threads_by_name.find(name);
+   return (found != x_threads_by_name.end()) ? found->second : nullptr;
+}
+
+static bool captureThread(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, ThreadSnapshot *snapshot)
+{
+   jvmtiThreadInfo info;
+   if (!ok(jvmti->GetThreadState(thread, &snapshot->state)) ||
+         !ok(jvmti->GetThreadInfo(thread, &info))) {
+      return false;
+   }
+
+   if (!cpu_time_enabled || !ok(jvmti->GetThreadCpuTime(thread, &snapshot->cpu_time))) {
+      snapshot->cpu_time = 0;
+   }
+
+   snapshot->name = info.name;
+   snapshot->daemon = info.is_daemon;
+   snapshot->priority = info.priority;
+   jvmti->Deallocate((unsigned char *) info.name);
+   jni->DeleteLocalRef(info.thread_group);
+   jni->DeleteLocalRef(info.context_class_loader);
+
+   StackTrace trace;
+   bool done = false;
+
+   jvmti->RawMonitorEnter(x_trace_lock);
+
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      snapshot->tid = tag->tid;
+      snapshot->serial = tag->serial;
+      renameThread(tag, snapshot->name.c_str());
+      done = captureTrace(jvmti, tag, &trace);
+   }
+
+   jvmti->RawMonitorExit(x_trace_lock);
+
+   if (!done) {
+      return false;
+   }
+
+   snapshot->context = trace.context;
+   snapshot->frames.clear();
+   if (trace.num_frames > 0) {
+      snapshot->frames.assign(trace.frames, trace.frames + trace.num_frames);
+   }
+   return true;
+}
+
+// must be called with x_trace_lock held
+static ThreadTag *findThread(const Request *request, FILE *out)
+{
+   jlong value;
+   const char *text;
+   if ((text = requestArg(request, "id")) != nullptr) {
+      if (!parseLong(text, &value)) {
+         fprintf(out, "ERROR: invalid id: %s\n", text);
+         return nullptr;
+      }
+      auto found = x_threads_by_java_id.find(value);
+      return (found != x_threads_by_java_id.end()) ? found->second : nullptr;
+   }
+   if ((text = requestArg(request, "tid")) != nullptr) {
+      if (!parseLong(text, &value)) {
+         fprintf(out, "ERROR: invalid tid: %s\n", text);
+         return nullptr;
+      }
+      auto found = x_threads_by_tid.find(value);
+      return (found != x_threads_by_tid.end()) ? found->second : nullptr;
+   }
+   if ((text = requestArg(request, "name")) != nullptr) {
+      return findThreadByName(text);
+   }
+   fprintf(out, "ERROR: thread requires id, tid or name\n");
+   return nullptr;
+}
+
+static void printSingleThread(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   jlong count = 1;
+   const char *count_text = requestArg(request, "count");
+   if ((count_text != nullptr) && (!parseLong(count_text, &count) || (count <= 0))) {
+      fprintf(out, "ERROR: invalid count: %s\n", count_text);
+      return;
+   }
+
+   jlong interval = 10;
+   const char *interval_text = requestArg(request, "interval");
+   if ((interval_text != nullptr) && (!parseLong(interval_text, &interval) || (interval < 0))) {
+      fprintf(out, "ERROR: invalid interval: %s\n", interval_text);
+      return;
+   }
+
+   jlong start = monotonicNanos();
+   for (jlong i = 0; i < count; i++) {
+      if (i > 0) {
+         timespec delay;
+         delay.tv_sec = interval / 1000;
+         delay.tv_nsec = (interval % 1000) * 1000 * 1000;
+         nanosleep(&delay, nullptr);
+      }
+
+      // the thread is resolved again for every sample, since it may end
+      // while the lock is released between samples
+      ThreadSnapshot thread;
+      bool captured = false;
+      bool found = false;
+
+      jvmti->RawMonitorEnter(x_trace_lock);
+      ThreadTag *tag = findThread(request, out);
+      if (tag != nullptr) {
+         found = true;
+         captured = captureThread(jvmti, jni, tag->thread, &thread);
+      }
+      jvmti->RawMonitorExit(x_trace_lock);
+
+      // a thread renamed since it was last sampled is only found once
+      // the names are refreshed
+      if (!found && (i == 0) && (requestArg(request, "name") != nullptr)) {
+         refreshThreadNames(jvmti, jni);
+         jvmti->RawMonitorEnter(x_trace_lock);
+         tag = findThread(request, out);
+         if (tag != nullptr) {
+            found = true;
+            captured = captureThread(jvmti, jni, tag->thread, &thread);
+         }
+         jvmti->RawMonitorExit(x_trace_lock);
+      }
+
+      if (!found) {
+         if (i == 0) {
+            fprintf(out, "ERROR: thread not found\n");
+         }
+         return;
+      }
+      if (!captured) {
+         continue;
+      }
+
+      printThreadHeader(&thread, out);
+      if (count > 1) {
+         fprintf(out, "  astack.sample: %lld of %lld at +%lld us\n",
+            (long long) (i + 1),
+            (long long) count,
+            (long long) ((monotonicNanos() - start) / 1000));
+      }
+      printContext(&thread.context, out);
+      printFrames(jvmti, jni, thread.frames.data(), thread.frames.size(), out);
+      fprintf(out, "\n");
+      fflush(out);
+   }
+}
+
+// Copy the GC pauses from index since on, and return the index after the
+// last one. Pauses overwritten while they were copied are left out.
+static jlong copyGcPauses(jlong since, std::vector<GcPause> *pauses)
+{
+   jlong count = x_gc_count.load(std::memory_order_acquire);
+   jlong first = std::max(since, count - GC_PAUSE_SLOTS);
+   std::vector<GcPause> copied;
+   for (jlong i = first; i < count; i++) {
+      copied.push_back(x_gc_pauses[i % GC_PAUSE_SLOTS]);
+   }
+   std::atomic_thread_fence(std::memory_order_acquire);
+   jlong valid = x_gc_writing.load(std::memory_order_relaxed) - GC_PAUSE_SLOTS;
+   for (jlong i = std::max(first, valid); i < count; i++) {
+      pauses->push_back(copied[i - first]);
+   }
+   return count;
+}
+
+// the pauses and GC time overlapping [from, to), in wall clock microseconds
+static void gcOverlap(const std::vector<GcPause> &pauses, jlong from, jlong to, jlong *count, jlong *nanos)
+{
+   for (const GcPause &pause : pauses) {
+      jlong start = std::max(pause.start_micros, from);
+      jlong end = std::min(pause.start_micros + (pause.nanos / 1000), to);
+      if (end >= start) {
+         (*count)++;
+         *nanos += (end - start) * 1000;
+      }
+   }
+}
+
+// capture the raw stacks of all threads first, and symbolize afterwards
+static bool captureSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, Snapshot *snapshot)
+{
+   jlong start_micros = currentTimeMicros();
+   jint count;
+   jthread *threads;
+   auto err = jvmti->GetAllThreads(&count, &threads);
+   if (!ok(err)) {
+      fprintf(stderr, "WARNING: GetAllThreads failed: %d\n", err);
+      return false;
+   }
+
+   snapshot->id = ++x_last_snapshot_id;
+   snapshot->time_millis = currentTimeMillis();
+   snapshot->threads.clear();
+   snapshot->threads.reserve(count);
+
+   for (int i = 0; i < count; i++) {
+      auto thread = threads[i];
+      snapshot->threads.emplace_back();
+      if (!captureThread(jvmti, jni, thread, &snapshot->threads.back())) {
+         snapshot->threads.pop_back();
+      }
+      jni->DeleteLocalRef(thread);
+   }
+
+   jvmti->Deallocate((unsigned char *) threads);
+
+   snapshot->gc_pauses = 0;
+   snapshot->gc_nanos = 0;
+   if (gc) {
+      std::vector<GcPause> pauses;
+      copyGcPauses(0, &pauses);
+      gcOverlap(pauses, start_micros, currentTimeMicros(), &snapshot->gc_pauses, &snapshot->gc_nanos);
+   }
+   return true;
+}
+
+static void writeTextDump(jvmtiEnv *jvmti, JNIEnv *jni, const Snapshot *snapshot, FILE *out)
+{
+   for (const ThreadSnapshot &thread : snapshot->threads) {
+      printThreadDump(jvmti, jni, &thread, out);
+   }
+}
+
+static void appendFoldedName(std::string &stack, const char *name)
+{
+   // semicolons separate frames in the folded format
+   for (const char *p = name; *p != '\0'; p++) {
+      stack += (*p == ';') ? '_' : *p;
+   }
+}
+
+// append the context as the root frame of a folded stack, giving one
+// flame per context
+static void appendFoldedContext(std::string &stack, const ThreadContext &context)
+{
+   if (context.label[0] != '\0') {
+      stack += '[';
+      appendFoldedName(stack, context.label);
+      stack += ']';
+   }
+   else if (context.id != 0) {
+      stack += "[" + std::to_string((long long) context.id) + "]";
+   }
+}
+
+// append the frames, outermost first, to a folded stack
+static void appendFoldedFrames(jvmtiEnv *jvmti, JNIEnv *jni, const AsyncCallFrame *frames, jint num_frames,
+      std::vector<EmittedFrame> *emitted, std::string &stack)
+{
+   foldFrames(jvmti, jni, frames, num_frames, emitted);
+   for (int i = emitted->size() - 1; i >= 0; i--) {
+      const EmittedFrame &frame = (*emitted)[i];
+      if (!stack.empty()) {
+         stack += ';';
+      }
+      if (frame.method == nullptr) {
+         stack += '[';
+         appendFoldedName(stack, fold_rules[frame.lineno].label.c_str());
+         stack += ']';
+         continue;
+      }
+      const MethodInfo *info = lookupMethod(jvmti, jni, frame.method);
+      appendFoldedName(stack, info->class_name.c_str());
+      stack += '.';
+      appendFoldedName(stack, info->method_name.c_str());
+   }
+}
+
+static void writeFolded(jvmtiEnv *jvmti, JNIEnv *jni, const Snapshot *snapshot, bool thread_names, FILE *out)
+{
+   std::map<std::string, jlong> stacks;
+   std::string stack;
+   std::vector<EmittedFrame> emitted;
+
+   for (const ThreadSnapshot &thread : snapshot->threads) {
+      stack.clear();
+
+      appendFoldedContext(stack, thread.context);
+      if (thread_names) {
+         if (!stack.empty()) {
+            stack += ';';
+         }
+         stack += '[';
+         appendFoldedName(stack, thread.name.c_str());
+         stack += ']';
+      }
+
+      appendFoldedFrames(jvmti, jni, thread.frames.data(), thread.frames.size(), &emitted, stack);
+
+      if (!stack.empty()) {
+         stacks[stack]++;
+      }
+   }
+
+   for (const auto &entry : stacks) {
+      fprintf(out, "%s %lld\n", entry.first.c_str(), (long long) entry.second);
+   }
+}
+
+void BinaryWriter::u8(uint8_t value)
+{
+   buffer.push_back(value);
+}
+
+void BinaryWriter::u16(uint16_t value)
+{
+   u8(value);
+   u8(value >> 8);
+}
+
+void BinaryWriter::u32(uint32_t value)
+{
+   u16(value);
+   u16(value >> 16);
+}
+
+void BinaryWriter::u64(uint64_t value)
+{
+   u32(value);
+   u32(value >> 32);
+}
+
+void BinaryWriter::str(const char *value)
+{
+   size_t len = strnlen(value, UINT16_MAX);
+   u16(len);
+   buffer.insert(buffer.end(), value, value + len);
+}
+
+void BinaryWriter::beginRecord(uint8_t type)
+{
+   u8(type);
+   record_start = buffer.size();
+   u32(0);
+}
+
+void BinaryWriter::endRecord()
+{
+   uint32_t length = buffer.size() - record_start - 4;
+   for (int i = 0; i < 4; i++) {
+      buffer[record_start + i] = length >> (i * 8);
+   }
+   flush(false);
+}
+
+void BinaryWriter::flush(bool force)
+{
+   if ((out != nullptr) && (force || (buffer.size() >= 64 * 1024))) {
+      fwrite(buffer.data(), 1, buffer.size(), out);
+      buffer.clear();
+   }
+}
+
+void ProtoWriter::varint(uint64_t value)
+{
+   while (value >= 0x80) {
+      out += (char) ((value & 0x7F) | 0x80);
+      value >>= 7;
+   }
+   out += (char) value;
+}
+
+void ProtoWriter::key(int field, int wire_type)
+{
+   varint((field << 3) | wire_type);
+}
+
+void ProtoWriter::uint(int field, uint64_t value)
+{
+   key(field, 0);
+   varint(value);
+}
+
+void ProtoWriter::bytes(int field, const std::string &value)
+{
+   key(field, 2);
+   varint(value.size());
+   out += value;
+}
+
+void ProtoWriter::packed(int field, const std::vector<uint64_t> &values)
+{
+   ProtoWriter payload;
+   for (uint64_t value : values) {
+      payload.varint(value);
+   }
+   bytes(field, payload.out);
+}
+
+static void writeBinaryHeader(BinaryWriter *writer)
+{
+   for (char c : ASTACK_MAGIC) {
+      writer->u8(c);
+   }
+   writer->u16(ASTACK_VERSION);
+}
+
+static void writeBinaryMethod(jvmtiEnv *jvmti, JNIEnv *jni, BinaryWriter *writer, jmethodID method)
+{
+   if (!writer->methods.insert(method).second) {
+      return;
+   }
+
+   const MethodInfo *info = lookupMethod(jvmti, jni, method);
+   writer->beginRecord(ASTACK_RECORD_METHOD);
+   writer->u64((uint64_t) method);
+   writer->str(info->class_name.c_str());
+   writer->str(info->method_name.c_str());
+   writer->str(info->source_name.c_str());
+   writer->endRecord();
+}
+
+// method records go to the dictionary, which is the writer itself except
+// for spool segments
+static void writeBinaryThread(jvmtiEnv *jvmti, JNIEnv *jni, const ThreadSnapshot *thread, BinaryWriter *writer,
+      BinaryWriter *dictionary)
+{
+   // method records must precede the thread record referring to them
+   for (const AsyncCallFrame &frame : thread->frames) {
+      writeBinaryMethod(jvmti, jni, dictionary, frame.method);
+   }
+
+   writer->beginRecord(ASTACK_RECORD_THREAD);
+   writer->u32(thread->tid);
+   writer->u32(thread->state);
+   writer->u8(thread->daemon);
+   writer->u32(thread->priority);
+   writer->u64(thread->context.id);
+   writer->str(thread->context.label);
+   writer->str(thread->name.c_str());
+   writer->u32(thread->frames.size());
+   for (const AsyncCallFrame &frame : thread->frames) {
+      const MethodInfo *info = lookupMethod(jvmti, jni, frame.method);
+      writer->u64((uint64_t) frame.method);
+      writer->u32(getLineNumber(info, frame.lineno));
+   }
+   writer->endRecord();
+}
+
+static void writeBinarySnapshot(jvmtiEnv *jvmti, JNIEnv *jni, const Snapshot *snapshot, BinaryWriter *writer)
+{
+   writer->beginRecord(ASTACK_RECORD_SNAPSHOT);
+   writer->u64(snapshot->id);
+   writer->u64(snapshot->time_millis);
+   writer->u32(snapshot->threads.size());
+   writer->endRecord();
+
+   for (const ThreadSnapshot &thread : snapshot->threads) {
+      writeBinaryThread(jvmti, jni, &thread, writer, writer);
+   }
+}
+
+static bool parseFormat(const char *text, SnapshotFormat *format)
+{
+   if ((text == nullptr) || (strcmp(text, "text") == 0)) {
+      *format = FORMAT_TEXT;
+   }
+   else if (strcmp(text, "folded") == 0) {
+      *format = FORMAT_FOLDED;
+   }
+   else if (strcmp(text, "binary") == 0) {
+      *format = FORMAT_BINARY;
+   }
+   else {
+      return false;
+   }
+   return true;
+}
+
+static void writeSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, const Snapshot *snapshot, SnapshotFormat format, FILE *out)
+{
+   switch (format) {
+      case FORMAT_TEXT:
+         writeTextDump(jvmti, jni, snapshot, out);
+         break;
+      case FORMAT_FOLDED:
+         writeFolded(jvmti, jni, snapshot, false, out);
+         break;
+      case FORMAT_BINARY: {
+         BinaryWriter writer;
+         writer.out = out;
+         writeBinaryHeader(&writer);
+         writeBinarySnapshot(jvmti, jni, snapshot, &writer);
+         writer.flush(true);
+         break;
+      }
+   }
+}
+
+static void putU32(uint8_t *p, uint32_t value)
+{
+   for (int i = 0; i < 4; i++) {
+      p[i] = value >> (i * 8);
+   }
+}
+
+static uint32_t getU32(const uint8_t *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void putU64(uint8_t *p, uint64_t value)
+{
+   for (int i = 0; i < 8; i++) {
+      p[i] = value >> (i * 8);
+   }
+}
+
+static void spoolPath(uint32_t sequence, char *path, size_t size)
+{
+   snprintf(path, size, "%s/astack-%d-%06u.seg", spool_dir.c_str(), (int) getpid(), sequence);
+}
+
+// must be called with x_spool_lock held
+static void spoolUpdateHeader(jlong time_millis)
+{
+   putU64(x_spool.map + ASTACK_SEGMENT_END_TIME, time_millis);
+   putU32(x_spool.map + ASTACK_SEGMENT_DATA_END, x_spool.data_end);
+   putU32(x_spool.map + ASTACK_SEGMENT_DICTIONARY_START, x_spool.dictionary_start);
+   putU32(x_spool.map + ASTACK_SEGMENT_INDEX_COUNT, x_spool.index_count);
+}
+
+// must be called with x_spool_lock held
+static void spoolCloseSegment()
+{
+   if (x_spool.map == nullptr) {
+      return;
+   }
+   msync(x_spool.map, spool_size, MS_ASYNC);
+   munmap(x_spool.map, spool_size);
+   close(x_spool.fd);
+   x_spool.map = nullptr;
+   x_spool.fd = -1;
+}
+
+// must be called with x_spool_lock held
+static bool spoolOpenSegment(uint32_t sequence)
+{
+   char path[PATH_MAX];
+   spoolPath(sequence, path, sizeof(path));
+
+   int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      fprintf(stderr, "ERROR: AStack: failed to create spool segment %s: %s\n", path, strerror(errno));
+      return false;
+   }
+   if (ftruncate(fd, spool_size) != 0) {
+      fprintf(stderr, "ERROR: AStack: failed to size spool segment %s: %s\n", path, strerror(errno));
+      close(fd);
+      return false;
+   }
+   void *map = mmap(nullptr, spool_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "ERROR: AStack: failed to map spool segment %s: %s\n", path, strerror(errno));
+      close(fd);
+      return false;
+   }
+
+   // the index entries are zero until used
+   jlong now = currentTimeMillis();
+   BinaryWriter header;
+   writeBinaryHeader(&header);
+   header.beginRecord(ASTACK_RECORD_SEGMENT);
+   header.u64(now);
+   header.u64(now);
+   header.u32(sequence);
+   header.u32(0);
+   header.u32(0);
+   header.u32(0);
+   header.u32(SPOOL_INDEX_CAPACITY);
+   header.buffer.resize(ASTACK_SEGMENT_INDEX + (SPOOL_INDEX_CAPACITY * ASTACK_SEGMENT_INDEX_ENTRY_SIZE));
+   header.endRecord();
+   memcpy(map, header.buffer.data(), header.buffer.size());
+
+   x_spool.fd = fd;
+   x_spool.map = (uint8_t *) map;
+   x_spool.sequence = sequence;
+   x_spool.data_end = header.buffer.size();
+   x_spool.dictionary_start = spool_size;
+   x_spool.index_count = 0;
+   x_spool.last_second = -1;
+   x_spool.dictionary.methods.clear();
+   x_spool.stacks.clear();
+   x_spool.stack_frames.clear();
+   x_spool.thread_names.clear();
+   x_spool.context_labels.clear();
+   spoolUpdateHeader(now);
+
+   // keep a bounded number of segments of this process
+   if (sequence >= spool_segments) {
+      spoolPath(sequence - spool_segments, path, sizeof(path));
+      unlink(path);
+   }
+   return true;
+}
+
+static bool spoolOpen()
+{
+   if ((mkdir(spool_dir.c_str(), 0755) != 0) && (errno != EEXIST)) {
+      fprintf(stderr, "ERROR: AStack: failed to create spool directory %s: %s\n", spool_dir.c_str(), strerror(errno));
+      return false;
+   }
+   return spoolOpenSegment(0);
+}
+
+// whether records committed at the time start a new index entry, must be
+// called with x_spool_lock held
+static bool spoolIndexPoint(jlong time_millis)
+{
+   return ((time_millis / 1000) > x_spool.last_second) && (x_spool.index_count < SPOOL_INDEX_CAPACITY);
+}
+
+// must be called with x_spool_lock held; copies the data records and the
+// new dictionary records, if both fit the segment
+static bool spoolCommit(jlong time_millis, const BinaryWriter &data)
+{
+   size_t dictionary_size = x_spool.dictionary.buffer.size();
+   if ((x_spool.data_end + data.buffer.size() + dictionary_size) > x_spool.dictionary_start) {
+      return false;
+   }
+
+   // dictionary blocks are prepended, each of them a valid record stream
+   x_spool.dictionary_start -= dictionary_size;
+   memcpy(x_spool.map + x_spool.dictionary_start, x_spool.dictionary.buffer.data(), dictionary_size);
+
+   if (spoolIndexPoint(time_millis)) {
+      uint8_t *entry = x_spool.map + ASTACK_SEGMENT_INDEX + (x_spool.index_count * ASTACK_SEGMENT_INDEX_ENTRY_SIZE);
+      putU64(entry, time_millis);
+      putU32(entry + 8, x_spool.data_end);
+      x_spool.index_count++;
+      x_spool.last_second = time_millis / 1000;
+   }
+
+   memcpy(x_spool.map + x_spool.data_end, data.buffer.data(), data.buffer.size());
+   x_spool.data_end += data.buffer.size();
+   spoolUpdateHeader(time_millis);
+   return true;
+}
+
+// Append the records produced by build, moving to the next segment if they
+// do not fit. The builder runs again for the new segment, whose dictionary
+// is empty.
+template <typename Builder>
+static void spoolWrite(jvmtiEnv *jvmti, jlong time_millis, Builder build)
+{
+   jvmti->RawMonitorEnter(x_spool_lock);
+
+   for (int attempt = 0; x_spool.map != nullptr; attempt++) {
+      // a reader seeking to an index entry skips the data before it, so
+      // thread names and context labels are written again after each one
+      if (spoolIndexPoint(time_millis)) {
+         x_spool.thread_names.clear();
+         x_spool.context_labels.clear();
+      }
+
+      BinaryWriter data;
+      x_spool.dictionary.buffer.clear();
+      build(&data);
+      if (spoolCommit(time_millis, data)) {
+         break;
+      }
+      if (attempt > 0) {
+         // the segment was opened for this attempt, so its state before
+         // the build was empty, and the IDs registered by the build must
+         // not be referred to by later records
+         x_spool.dictionary.methods.clear();
+         x_spool.stacks.clear();
+         x_spool.stack_frames.clear();
+         x_spool.thread_names.clear();
+         x_spool.context_labels.clear();
+         if (!x_spool.dropped) {
+            fprintf(stderr, "WARNING: AStack: record of %zu bytes does not fit a spool segment\n", data.buffer.size());
+            x_spool.dropped = true;
+         }
+         break;
+      }
+      uint32_t sequence = x_spool.sequence + 1;
+      spoolCloseSegment();
+      spoolOpenSegment(sequence);
+   }
+   x_spool.dictionary.buffer.clear();
+
+   jvmti->RawMonitorExit(x_spool_lock);
+}
+
+// Whether the label of a context differs from the last one written for its
+// id, in which case it is remembered as written. An id that is not in the
+// map is written even with an empty label, since a reader may still hold
+// a label for it, so forgetting labels only writes them again and the map
+// is cleared once it is large.
+static bool contextLabelChanged(std::unordered_map<jlong, std::string> *labels, const ThreadContext &context)
+{
+   auto found = labels->find(context.id);
+   if ((found != labels->end()) && (found->second == context.label)) {
+      return false;
+   }
+   if (labels->size() >= MAX_CONTEXT_LABELS) {
+      labels->clear();
+   }
+   (*labels)[context.id] = context.label;
+   return true;
+}
+
+static void writeContextLabel(BinaryWriter *writer, jlong id, const char *label)
+{
+   writer->beginRecord(ASTACK_RECORD_CONTEXT_LABEL);
+   writer->u64(id);
+   writer->str(label);
+   writer->endRecord();
+}
+
+// must be called with x_spool_lock held, stacks are identified within the
+// segment by their frames, and found by the frame hash like in internStack
+static uint32_t spoolStack(jvmtiEnv *jvmti, JNIEnv *jni, const StackTrace *trace)
+{
+   uint64_t probe = hashFrames(trace->frames, trace->num_frames, 0);
+   while (true) {
+      auto found = x_spool.stacks.find(probe);
+      if (found == x_spool.stacks.end()) {
+         break;
+      }
+      const std::vector<AsyncCallFrame> &frames = x_spool.stack_frames[found->second];
+      if ((frames.size() == (size_t) trace->num_frames) &&
+            std::equal(frames.begin(), frames.end(), trace->frames, [](const AsyncCallFrame &a, const AsyncCallFrame &b) {
+               return (a.method == b.method) && (a.lineno == b.lineno);
+            })) {
+         return found->second;
+      }
+      probe++;
+   }
+
+   BinaryWriter *dictionary = &x_spool.dictionary;
+   for (int i = 0; i < trace->num_frames; i++) {
+      writeBinaryMethod(jvmti, jni, dictionary, trace->frames[i].method);
+   }
+
+   uint32_t id = x_spool.stack_frames.size();
+   x_spool.stack_frames.emplace_back(trace->frames, trace->frames + trace->num_frames);
+   x_spool.stacks[probe] = id;
+   dictionary->beginRecord(ASTACK_RECORD_STACK);
+   dictionary->u32(id);
+   dictionary->u32(trace->num_frames);
+   for (int i = 0; i < trace->num_frames; i++) {
+      const MethodInfo *info = lookupMethod(jvmti, jni, trace->frames[i].method);
+      dictionary->u64((uint64_t) trace->frames[i].method);
+      dictionary->u32(getLineNumber(info, trace->frames[i].lineno));
+   }
+   dictionary->endRecord();
+   return id;
+}
+
+static void spoolSample(jvmtiEnv *jvmti, JNIEnv *jni, const StackTrace *trace, pid_t tid, const std::string &name,
+      jint state, jlong time_millis)
+{
+   spoolWrite(jvmti, time_millis, [&](BinaryWriter *data) {
+      // Kernel thread IDs are reused, so a tid is named again when its name
+      // changes. The name goes to the data area rather than the dictionary,
+      // which is read newest first, so that it applies to later samples only.
+      auto found = x_spool.thread_names.find(tid);
+      if ((found == x_spool.thread_names.end()) || (found->second != name)) {
+         x_spool.thread_names[tid] = name;
+         data->beginRecord(ASTACK_RECORD_THREAD_NAME);
+         data->u32(tid);
+         data->str(name.c_str());
+         data->endRecord();
+      }
+      if (contextLabelChanged(&x_spool.context_labels, trace->context)) {
+         writeContextLabel(data, trace->context.id, trace->context.label);
+      }
+
+      uint32_t id = spoolStack(jvmti, jni, trace);
+      data->beginRecord(ASTACK_RECORD_SAMPLE);
+      data->u64(time_millis);
+      data->u32(tid);
+      data->u32(state);
+      data->u64(trace->context.id);
+      data->u32(id);
+      data->endRecord();
+   });
+}
+
+static void spoolSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, const Snapshot *snapshot)
+{
+   spoolWrite(jvmti, snapshot->time_millis, [&](BinaryWriter *data) {
+      data->beginRecord(ASTACK_RECORD_SNAPSHOT);
+      data->u64(snapshot->id);
+      data->u64(snapshot->time_millis);
+      data->u32(snapshot->threads.size());
+      data->endRecord();
+      for (const ThreadSnapshot &thread : snapshot->threads) {
+         writeBinaryThread(jvmti, jni, &thread, data, &x_spool.dictionary);
+      }
+   });
+}
+
+static uint8_t *ringData(uint64_t sequence)
+{
+   return x_ring.map + ASTACK_RING_HEADER_SIZE + (sequence % x_ring.capacity);
+}
+
+static uint64_t ringRecordSize(uint64_t length)
+{
+   return (ASTACK_RECORD_HEADER_SIZE + length + 7) & ~7ULL;
+}
+
+// move the tail past the records that the next size bytes overwrite
+static void ringMakeRoom(uint64_t size)
+{
+   uint64_t tail = x_ring.tail;
+   while ((x_ring.head + size - tail) > x_ring.capacity) {
+      tail += ringRecordSize(getU32(ringData(tail) + 1));
+   }
+   if (tail != x_ring.tail) {
+      x_ring.tail = tail;
+      __atomic_store_n((uint64_t *) (x_ring.map + ASTACK_RING_TAIL), tail, __ATOMIC_RELEASE);
+   }
+}
+
+// write one record at the head without publishing it
+static void ringWrite(const uint8_t *record, uint32_t length)
+{
+   uint64_t size = ringRecordSize(length);
+   uint64_t position = x_ring.head % x_ring.capacity;
+   if ((position + size) > x_ring.capacity) {
+      // sizes are multiples of 8, so the padding fits a record header
+      uint64_t padding = x_ring.capacity - position;
+      ringMakeRoom(padding);
+      uint8_t *data = ringData(x_ring.head);
+      data[0] = 0;
+      putU32(data + 1, padding - ASTACK_RECORD_HEADER_SIZE);
+      x_ring.head += padding;
+   }
+
+   ringMakeRoom(size);
+   uint8_t *data = ringData(x_ring.head);
+   data[0] = record[0];
+   putU32(data + 1, length);
+   memcpy(data + ASTACK_RECORD_HEADER_SIZE, record + ASTACK_RECORD_HEADER_SIZE, length);
+   x_ring.head += size;
+}
+
+// write the records of the batch, then publish them together
+static void ringPublish(const BinaryWriter &batch)
+{
+   const uint8_t *p = batch.buffer.data();
+   const uint8_t *end = p + batch.buffer.size();
+   while (p < end) {
+      uint32_t length = getU32(p + 1);
+      ringWrite(p, length);
+      p += ASTACK_RECORD_HEADER_SIZE + length;
+   }
+   __atomic_store_n((uint64_t *) (x_ring.map + ASTACK_RING_HEAD), x_ring.head, __ATOMIC_RELEASE);
+}
+
+static void ringMethod(jvmtiEnv *jvmti, JNIEnv *jni, BinaryWriter *batch, jmethodID method)
+{
+   const MethodInfo *info = lookupMethod(jvmti, jni, method);
+   batch->beginRecord(ASTACK_RECORD_METHOD);
+   batch->u64((uint64_t) method);
+   batch->str(info->class_name.c_str());
+   batch->str(info->method_name.c_str());
+   batch->str(info->source_name.c_str());
+   batch->endRecord();
+
+   batch->beginRecord(ASTACK_RECORD_LINE_TABLE);
+   batch->u64((uint64_t) method);
+   batch->u32(info->line_numbers.size());
+   for (const jvmtiLineNumberEntry &entry : info->line_numbers) {
+      batch->u64(entry.start_location);
+      batch->u32(entry.line_number);
+   }
+   batch->endRecord();
+}
+
+static void ringThreadName(BinaryWriter *batch, pid_t tid, const std::string &name)
+{
+   batch->beginRecord(ASTACK_RECORD_THREAD_NAME);
+   batch->u32(tid);
+   batch->str(name.c_str());
+   batch->endRecord();
+}
+
+// Forget which methods, thread names and context labels were published,
+// so that later batches write them again before they use them.
+static void ringForget()
+{
+   x_ring.methods.clear();
+   x_ring.thread_names.clear();
+   x_ring.context_labels.clear();
+}
+
+// Start a new dictionary once the last one is about to be overwritten,
+// and return whether it did. The dictionary record is only a marker: a
+// consumer starting at it has seen nothing, so everything published
+// before it is forgotten and written again by the batches after it.
+static bool ringDictionary(uint64_t size)
+{
+   if ((x_ring.head + size - x_ring.dictionary) <= x_ring.capacity) {
+      return false;
+   }
+
+   BinaryWriter dictionary;
+   dictionary.beginRecord(ASTACK_RECORD_DICTIONARY);
+   dictionary.endRecord();
+
+   // padding may precede the dictionary record
+   x_ring.dictionary = x_ring.head;
+   ringPublish(dictionary);
+   __atomic_store_n((uint64_t *) (x_ring.map + ASTACK_RING_DICTIONARY), x_ring.dictionary, __ATOMIC_RELEASE);
+   ringForget();
+   return true;
+}
+
+// the records of one sample, preceded by those it uses that were not
+// published since the last dictionary
+static void ringBatch(jvmtiEnv *jvmti, JNIEnv *jni, const StackTrace *trace, pid_t tid, const std::string &name,
+      jint state, jlong time_millis)
+{
+   BinaryWriter *batch = &x_ring.batch;
+   batch->buffer.clear();
+
+   auto found = x_ring.thread_names.find(tid);
+   if ((found == x_ring.thread_names.end()) || (found->second != name)) {
+      x_ring.thread_names[tid] = name;
+      ringThreadName(batch, tid, name);
+   }
+   if (contextLabelChanged(&x_ring.context_labels, trace->context)) {
+      writeContextLabel(batch, trace->context.id, trace->context.label);
+   }
+   for (int i = 0; i < trace->num_frames; i++) {
+      jmethodID method = trace->frames[i].method;
+      if (x_ring.methods.insert(method).second) {
+         ringMethod(jvmti, jni, batch, method);
+      }
+   }
+
+   batch->beginRecord(ASTACK_RECORD_RAW_SAMPLE);
+   batch->u64(time_millis);
+   batch->u32(tid);
+   batch->u32(state);
+   batch->u64(trace->context.id);
+   batch->u32(trace->num_frames);
+   for (int i = 0; i < trace->num_frames; i++) {
+      batch->u64((uint64_t) trace->frames[i].method);
+      batch->u32(trace->frames[i].lineno);
+   }
+   batch->endRecord();
+}
+
+static void ringSample(jvmtiEnv *jvmti, JNIEnv *jni, const StackTrace *trace, pid_t tid, const std::string &name,
+      jint state, jlong time_millis)
+{
+   ringBatch(jvmti, jni, trace, tid, name, state, time_millis);
+
+   // with padding, a batch takes at most twice its size, and a new
+   // dictionary needs a batch written after it
+   if ((x_ring.batch.buffer.size() <= (x_ring.capacity / 4)) && ringDictionary(x_ring.batch.buffer.size() * 2)) {
+      ringBatch(jvmti, jni, trace, tid, name, state, time_millis);
+   }
+
+   // the records of a dropped batch must be written again
+   if (x_ring.batch.buffer.size() > (x_ring.capacity / 4)) {
+      ringForget();
+      return;
+   }
+   ringPublish(x_ring.batch);
+}
+
+static bool ringOpen()
+{
+   int fd = open(ring_file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      fprintf(stderr, "ERROR: AStack: failed to create ring file %s: %s\n", ring_file.c_str(), strerror(errno));
+      return false;
+   }
+   size_t size = ASTACK_RING_HEADER_SIZE + ring_size;
+   if (ftruncate(fd, size) != 0) {
+      fprintf(stderr, "ERROR: AStack: failed to size ring file %s: %s\n", ring_file.c_str(), strerror(errno));
+      close(fd);
+      return false;
+   }
+   void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "ERROR: AStack: failed to map ring file %s: %s\n", ring_file.c_str(), strerror(errno));
+      return false;
+   }
+
+   x_ring.map = (uint8_t *) map;
+   x_ring.capacity = ring_size;
+   memcpy(x_ring.map, ASTACK_MAGIC, sizeof(ASTACK_MAGIC));
+   x_ring.map[4] = ASTACK_VERSION & 0xFF;
+   x_ring.map[5] = ASTACK_VERSION >> 8;
+   putU32(x_ring.map + ASTACK_RING_DATA_CAPACITY, ring_size);
+   putU64(x_ring.map + ASTACK_RING_PID, getpid());
+   putU64(x_ring.map + ASTACK_RING_START_TIME, currentTimeMillis());
+
+   // the first, empty dictionary
+   BinaryWriter dictionary;
+   dictionary.beginRecord(ASTACK_RECORD_DICTIONARY);
+   dictionary.endRecord();
+   ringPublish(dictionary);
+   return true;
+}
+
+static void splitList(const char *text, std::vector<std::string> *values)
+{
+   if (text == nullptr) {
+      return;
+   }
+   std::string value;
+   for (const char *p = text; ; p++) {
+      if ((*p == ',') || (*p == '\0')) {
+         if (!value.empty()) {
+            values->push_back(value);
+         }
+         value.clear();
+         if (*p == '\0') {
+            break;
+         }
+      }
+      else {
+         value += *p;
+      }
+   }
+}
+
+// Predicates are cached by their arguments, so the set of matching methods
+// is built once and then only grows as frames of new methods show up.
+// Only the listener thread uses them.
+static FramePredicate *findPredicate(const Request *request)
+{
+   const char *classes = requestArg(request, "class");
+   const char *methods = requestArg(request, "method");
+   if ((classes == nullptr) && (methods == nullptr)) {
+      return nullptr;
+   }
+
+   std::string key = std::string(classes ?: "") + "#" + (methods ?: "");
+   auto found = x_predicates.find(key);
+   if (found != x_predicates.end()) {
+      return &found->second;
+   }
+
+   if (x_predicates.size() >= MAX_PREDICATES) {
+      x_predicates.clear();
+   }
+   FramePredicate &predicate = x_predicates[key];
+   splitList(classes, &predicate.class_prefixes);
+   splitList(methods, &predicate.methods);
+   return &predicate;
+}
+
+static bool methodMatches(jvmtiEnv *jvmti, JNIEnv *jni, FramePredicate *predicate, jmethodID method)
+{
+   auto found = predicate->matches.find(method);
+   if (found != predicate->matches.end()) {
+      return found->second;
+   }
+
+   const MethodInfo *info = lookupMethod(jvmti, jni, method);
+   bool class_match = predicate->class_prefixes.empty();
+   for (const std::string &prefix : predicate->class_prefixes) {
+      if (info->class_name.compare(0, prefix.size(), prefix) == 0) {
+         class_match = true;
+         break;
+      }
+   }
+   bool method_match = predicate->methods.empty();
+   for (const std::string &name : predicate->methods) {
+      if (info->method_name == name) {
+         method_match = true;
+         break;
+      }
+   }
+
+   bool match = class_match && method_match;
+   predicate->matches[method] = match;
+   return match;
+}
+
+static void filterSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, FramePredicate *predicate, Snapshot *snapshot)
+{
+   auto matches = [&](const ThreadSnapshot &thread) {
+      for (const AsyncCallFrame &frame : thread.frames) {
+         if (methodMatches(jvmti, jni, predicate, frame.method)) {
+            return true;
+         }
+      }
+      return false;
+   };
+
+   auto end = std::remove_if(snapshot->threads.begin(), snapshot->threads.end(), [&](const ThreadSnapshot &thread) {
+      return !matches(thread);
+   });
+   snapshot->threads.erase(end, snapshot->threads.end());
+}
+
+static void retainSnapshot(jvmtiEnv *jvmti, const std::shared_ptr<const Snapshot> &snapshot)
+{
+   if (max_snapshots == 0) {
+      return;
+   }
+
+   jvmti->RawMonitorEnter(x_snapshot_lock);
+   x_snapshots.push_back(snapshot);
+   while (x_snapshots.size() > (size_t) max_snapshots) {
+      x_snapshots.pop_front();
+   }
+   jvmti->RawMonitorExit(x_snapshot_lock);
+}
+
+static std::shared_ptr<const Snapshot> findSnapshot(jvmtiEnv *jvmti, jlong id)
+{
+   std::shared_ptr<const Snapshot> result;
+
+   jvmti->RawMonitorEnter(x_snapshot_lock);
+   for (const auto &snapshot : x_snapshots) {
+      if (snapshot->id == id) {
+         result = snapshot;
+         break;
+      }
+   }
+   jvmti->RawMonitorExit(x_snapshot_lock);
+
+   return result;
+}
+
+static void keepSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, const std::shared_ptr<const Snapshot> &snapshot)
+{
+   retainSnapshot(jvmti, snapshot);
+   if (!spool_dir.empty()) {
+      spoolSnapshot(jvmti, jni, snapshot.get());
+   }
+}
+
+static std::shared_ptr<const Snapshot> captureRetainedSnapshot(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+   auto snapshot = std::make_shared<Snapshot>();
+   if (!captureSnapshot(jvmti, jni, snapshot.get())) {
+      return nullptr;
+   }
+   keepSnapshot(jvmti, jni, snapshot);
+   return snapshot;
+}
+
+static std::shared_ptr<const Snapshot> requestedSnapshot(jvmtiEnv *jvmti, const Request *request, const char *key, FILE *out)
+{
+   jlong id;
+   const char *text = requestArg(request, key);
+   if (text == nullptr) {
+      fprintf(out, "ERROR: missing %s snapshot\n", key);
+      return nullptr;
+   }
+   if (!parseLong(text, &id)) {
+      fprintf(out, "ERROR: invalid snapshot: %s\n", text);
+      return nullptr;
+   }
+
+   auto snapshot = findSnapshot(jvmti, id);
+   if (snapshot == nullptr) {
+      fprintf(out, "ERROR: unknown snapshot: %s\n", text);
+   }
+   return snapshot;
+}
+
+static bool parseCursor(const char *text, jlong *id, jlong *offset)
+{
+   const char *colon = strchr(text, ':');
+   if (colon == nullptr) {
+      return false;
+   }
+   std::string id_text(text, colon - text);
+   return parseLong(id_text.c_str(), id) && parseLong(colon + 1, offset) && (*offset >= 0);
+}
+
+// Capture all threads and retain them, or use the retained snapshot named
+// by the request or its cursor. Only threads matching the frame filter of
+// the request are returned, while the retained snapshot has all threads.
+// With unretained, a capture is not retained but stored there instead,
+// for the caller to keep.
+static std::shared_ptr<const Snapshot> requestSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request,
+      std::shared_ptr<const Snapshot> *unretained, FILE *out)
+{
+   FramePredicate *predicate = findPredicate(request);
+
+   std::shared_ptr<const Snapshot> snapshot;
+   const char *cursor = requestArg(request, "cursor");
+   if (cursor != nullptr) {
+      jlong id;
+      jlong offset;
+      if (!parseCursor(cursor, &id, &offset)) {
+         fprintf(out, "ERROR: invalid cursor: %s\n", cursor);
+         return nullptr;
+      }
+      snapshot = findSnapshot(jvmti, id);
+      if (snapshot == nullptr) {
+         fprintf(out, "ERROR: snapshot of cursor is no longer retained: %s\n", cursor);
+      }
+   }
+   else if (requestArg(request, "snapshot") != nullptr) {
+      snapshot = requestedSnapshot(jvmti, request, "snapshot", out);
+   }
+   else if (unretained != nullptr) {
+      auto captured = std::make_shared<Snapshot>();
+      if (captureSnapshot(jvmti, jni, captured.get())) {
+         snapshot = captured;
+         *unretained = captured;
+      }
+   }
+   else {
+      snapshot = captureRetainedSnapshot(jvmti, jni);
+   }
+
+   if ((snapshot == nullptr) || (predicate == nullptr)) {
+      return snapshot;
+   }
+
+   auto filtered = std::make_shared<Snapshot>(*snapshot);
+   filterSnapshot(jvmti, jni, predicate, filtered.get());
+   return filtered;
+}
+
+// limit from the request, which may lower but not exceed the server limit
+static bool pageLimit(const Request *request, const char *key, jlong server_limit, jlong *limit, FILE *out)
+{
+   *limit = server_limit;
+   const char *text = requestArg(request, key);
+   if (text == nullptr) {
+      return true;
+   }
+
+   jlong value;
+   if (!parseLong(text, &value) || (value <= 0)) {
+      fprintf(out, "ERROR: invalid %s: %s\n", key, text);
+      return false;
+   }
+   if ((server_limit == 0) || (value < server_limit)) {
+      *limit = value;
+   }
+   return true;
+}
+
+// Write the threads starting at offset, up to the thread and byte limits
+// (zero for none). At least one thread is always written, so a page makes
+// progress. If threads remain, the page ends with a cursor for the next one.
+static void writePage(jvmtiEnv *jvmti, JNIEnv *jni, const Snapshot *snapshot, SnapshotFormat format,
+      jlong offset, jlong limit, jlong bytes, FILE *out)
+{
+   size_t end = snapshot->threads.size();
+   size_t next = offset;
+
+   // the thread count of the snapshot record is patched once the page is known
+   BinaryWriter writer;
+   size_t count_position = 0;
+   if (format == FORMAT_BINARY) {
+      writeBinaryHeader(&writer);
+      writer.beginRecord(ASTACK_RECORD_SNAPSHOT);
+      writer.u64(snapshot->id);
+      writer.u64(snapshot->time_millis);
+      count_position = writer.buffer.size();
+      writer.u32(0);
+      writer.endRecord();
+   }
+
+   char *text = nullptr;
+   size_t text_size = 0;
+   FILE *page = nullptr;
+   if (format == FORMAT_TEXT) {
+      page = open_memstream(&text, &text_size);
+      if (page == nullptr) {
+         fprintf(out, "ERROR: failed to allocate page\n");
+         return;
+      }
+   }
+
+   while ((next < end) && ((limit == 0) || ((jlong) (next - offset) < limit))) {
+      const ThreadSnapshot *thread = &snapshot->threads[next];
+      if (format == FORMAT_BINARY) {
+         size_t before = writer.buffer.size();
+         writeBinaryThread(jvmti, jni, thread, &writer, &writer);
+         if ((bytes != 0) && ((jlong) writer.buffer.size() > bytes) && (next > (size_t) offset)) {
+            writer.buffer.resize(before);
+            break;
+         }
+      }
+      else {
+         long before = ftell(page);
+         printThreadDump(jvmti, jni, thread, page);
+         if ((bytes != 0) && (ftell(page) > bytes) && (next > (size_t) offset)) {
+            fseek(page, before, SEEK_SET);
+            break;
+         }
+      }
+      next++;
+   }
+
+   if (format == FORMAT_BINARY) {
+      uint32_t count = next - offset;
+      for (int i = 0; i < 4; i++) {
+         writer.buffer[count_position + i] = count >> (i * 8);
+      }
+      if (next < end) {
+         writer.beginRecord(ASTACK_RECORD_CURSOR);
+         writer.u64(snapshot->id);
+         writer.u32(next);
+         writer.endRecord();
+      }
+      fwrite(writer.buffer.data(), 1, writer.buffer.size(), out);
+   }
+   else {
+      // the stream size is the current position, which drops a truncated thread
+      fclose(page);
+      fwrite(text, 1, text_size, out);
+      free(text);
+      if (next < end) {
+         fprintf(out, "astack.cursor: %lld:%zu\n", (long long) snapshot->id, next);
+      }
+   }
+}
+
+static uint64_t mixHash(uint64_t value)
+{
+   // splitmix64 finalizer
+   value ^= value >> 30;
+   value *= 0xBF58476D1CE4E5B9ULL;
+   value ^= value >> 27;
+   value *= 0x94D049BB133111EBULL;
+   value ^= value >> 31;
+   return value;
+}
+
+// FNV-1a over the label, mixed with the id
+static uint64_t hashContext(const ThreadContext &context)
+{
+   uint64_t hash = 14695981039346656037ULL;
+   for (const char *p = context.label; *p != '\0'; p++) {
+      hash ^= (uint8_t) *p;
+      hash *= 1099511628211ULL;
+   }
+   return hash ^ mixHash(context.id);
+}
+
+// Fingerprint of the raw stacks, states and contexts of all threads. The
+// per-thread hashes are summed, so the order of threads does not matter.
+static uint64_t snapshotFingerprint(const Snapshot *snapshot)
+{
+   uint64_t fingerprint = mixHash(snapshot->threads.size());
+   for (const ThreadSnapshot &thread : snapshot->threads) {
+      uint64_t hash = hashFrames(thread.frames.data(), thread.frames.size(), thread.state);
+      hash = mixHash(hash ^ thread.serial);
+      hash = mixHash(hash ^ thread.context.id);
+      for (const char *p = thread.context.label; *p != '\0'; p++) {
+         hash = mixHash(hash ^ (unsigned char) *p);
+      }
+      fingerprint += hash;
+   }
+   return fingerprint;
+}
+
+static void printWaitReport(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out);
+
+static void dumpAllThreads(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   SnapshotFormat format;
+   if (!parseFormat(requestArg(request, "format"), &format)) {
+      fprintf(out, "ERROR: unknown format: %s\n", requestArg(request, "format"));
+      return;
+   }
+
+   // a client polling with the fingerprint of its last dump skips
+   // symbolizing and transferring a dump that has not changed, and an
+   // unchanged capture is neither retained nor spooled
+   const char *etag = requestArg(request, "if-none-match");
+   if ((etag != nullptr) && (format == FORMAT_BINARY)) {
+      // a binary dump must start with its magic, so there is no room for
+      // the fingerprint line
+      fprintf(out, "ERROR: if-none-match does not support the binary format\n");
+      return;
+   }
+   std::shared_ptr<const Snapshot> unretained;
+   auto snapshot = requestSnapshot(jvmti, jni, request, (etag != nullptr) ? &unretained : nullptr, out);
+   if (snapshot == nullptr) {
+      return;
+   }
+
+   if (etag != nullptr) {
+      char fingerprint[17];
+      snprintf(fingerprint, sizeof(fingerprint), "%016llx", (unsigned long long) snapshotFingerprint(snapshot.get()));
+      if (strcmp(etag, fingerprint) == 0) {
+         fprintf(out, "unchanged %s\n", fingerprint);
+         return;
+      }
+      fprintf(out, "etag %s\n", fingerprint);
+   }
+   if (unretained != nullptr) {
+      keepSnapshot(jvmti, jni, unretained);
+   }
+
+   if (format == FORMAT_FOLDED) {
+      writeFolded(jvmti, jni, snapshot.get(), requestFlag(request, "threads"), out);
+      return;
+   }
+
+   jlong limit;
+   jlong bytes;
+   if (!pageLimit(request, "limit", max_threads, &limit, out) ||
+         !pageLimit(request, "max_bytes", max_bytes, &bytes, out)) {
+      return;
+   }
+
+   jlong offset = 0;
+   jlong id;
+   const char *cursor = requestArg(request, "cursor");
+   if ((cursor != nullptr) && parseCursor(cursor, &id, &offset) && (offset > (jlong) snapshot->threads.size())) {
+      offset = snapshot->threads.size();
+   }
+
+   if ((limit == 0) && (bytes == 0) && (offset == 0)) {
+      writeSnapshot(jvmti, jni, snapshot.get(), format, out);
+   }
+   else {
+      writePage(jvmti, jni, snapshot.get(), format, offset, limit, bytes, out);
+   }
+
+   if ((format == FORMAT_TEXT) && (snapshot->gc_pauses > 0)) {
+      fprintf(out, "astack.gc: %lld pauses, %.1f ms during the capture\n",
+         (long long) snapshot->gc_pauses,
+         snapshot->gc_nanos / (1000.0 * 1000));
+   }
+
+   // the wait report follows the text dump, for a single request
+   if ((format == FORMAT_TEXT) && waits && requestFlag(request, "waits")) {
+      printWaitReport(jvmti, jni, request, out);
+   }
+}
+
+static void takeSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, FILE *out)
+{
+   auto snapshot = captureRetainedSnapshot(jvmti, jni);
+   if (snapshot != nullptr) {
+      char time[32];
+      formatTime(snapshot->time_millis, time, sizeof(time));
+      fprintf(out, "%lld %s %zu threads\n", (long long) snapshot->id, time, snapshot->threads.size());
+   }
+}
+
+static void listSnapshots(jvmtiEnv *jvmti, FILE *out)
+{
+   jvmti->RawMonitorEnter(x_snapshot_lock);
+   std::deque<std::shared_ptr<const Snapshot>> snapshots = x_snapshots;
+   jvmti->RawMonitorExit(x_snapshot_lock);
+
+   for (const auto &snapshot : snapshots) {
+      char time[32];
+      formatTime(snapshot->time_millis, time, sizeof(time));
+      fprintf(out, "%lld %s %zu threads\n", (long long) snapshot->id, time, snapshot->threads.size());
+   }
+}
+
+static void printDiffThread(const ThreadSnapshot *thread, FILE *out)
+{
+   fprintf(out, "  \"%s\" tid=%d %s\n", thread->name.c_str(), (int) thread->tid, threadStateEnum(thread->state));
+}
+
+// the snapshots named by the from and to arguments, or else the two most
+// recent snapshots
+static bool requestedSnapshots(jvmtiEnv *jvmti, const Request *request, std::shared_ptr<const Snapshot> *from,
+      std::shared_ptr<const Snapshot> *to, FILE *out)
+{
+   if ((requestArg(request, "from") == nullptr) && (requestArg(request, "to") == nullptr)) {
+      jvmti->RawMonitorEnter(x_snapshot_lock);
+      if (x_snapshots.size() >= 2) {
+         *from = x_snapshots[x_snapshots.size() - 2];
+         *to = x_snapshots.back();
+      }
+      jvmti->RawMonitorExit(x_snapshot_lock);
+      if (*to == nullptr) {
+         fprintf(out, "ERROR: %s requires two retained snapshots\n", request->command);
+         return false;
+      }
+      return true;
+   }
+
+   *from = requestedSnapshot(jvmti, request, "from", out);
+   if (*from == nullptr) {
+      return false;
+   }
+   *to = requestedSnapshot(jvmti, request, "to", out);
+   return *to != nullptr;
+}
+
+static void diffSnapshots(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   std::shared_ptr<const Snapshot> from;
+   std::shared_ptr<const Snapshot> to;
+   if (!requestedSnapshots(jvmti, request, &from, &to, out)) {
+      return;
+   }
+
+   bool stacks = !requestArg(request, "stacks") || requestFlag(request, "stacks");
+
+   std::unordered_map<jlong, const ThreadSnapshot *> before;
+   for (const ThreadSnapshot &thread : from->threads) {
+      before[thread.serial] = &thread;
+   }
+
+   std::vector<const ThreadSnapshot *> created;
+   std::vector<std::pair<const ThreadSnapshot *, const ThreadSnapshot *>> state_changes;
+   std::vector<const ThreadSnapshot *> stack_changes;
+   jlong unchanged = 0;
+   for (const ThreadSnapshot &thread : to->threads) {
+      auto found = before.find(thread.serial);
+      if (found == before.end()) {
+         created.push_back(&thread);
+         continue;
+      }
+      const ThreadSnapshot *previous = found->second;
+      before.erase(found);
+
+      if (previous->state != thread.state) {
+         state_changes.emplace_back(previous, &thread);
+      }
+
+      // compare raw frames rather than symbolized text
+      if (hashFrames(previous->frames.data(), previous->frames.size(), 0) !=
+            hashFrames(thread.frames.data(), thread.frames.size(), 0)) {
+         stack_changes.push_back(&thread);
+      }
+      else {
+         unchanged++;
+      }
+   }
+
+   char from_time[32];
+   char to_time[32];
+   formatTime(from->time_millis, from_time, sizeof(from_time));
+   formatTime(to->time_millis, to_time, sizeof(to_time));
+   fprintf(out, "Diff from snapshot %lld (%s) to %lld (%s)\n\n",
+      (long long) from->id, from_time, (long long) to->id, to_time);
+
+   fprintf(out, "Threads created: %zu\n", created.size());
+   for (const ThreadSnapshot *thread : created) {
+      printDiffThread(thread, out);
+   }
+
+   std::vector<const ThreadSnapshot *> ended;
+   for (const ThreadSnapshot &thread : from->threads) {
+      if (before.count(thread.serial) != 0) {
+         ended.push_back(&thread);
+      }
+   }
+   fprintf(out, "\nThreads ended: %zu\n", ended.size());
+   for (const ThreadSnapshot *thread : ended) {
+      printDiffThread(thread, out);
+   }
+
+   fprintf(out, "\nState changes: %zu\n", state_changes.size());
+   for (const auto &change : state_changes) {
+      fprintf(out, "  \"%s\" tid=%d %s -> %s\n",
+         change.second->name.c_str(),
+         (int) change.second->tid,
+         threadStateEnum(change.first->state),
+         threadStateEnum(change.second->state));
+   }
+
+   fprintf(out, "\nStacks changed: %zu\n", stack_changes.size());
+   for (const ThreadSnapshot *thread : stack_changes) {
+      printDiffThread(thread, out);
+      if (stacks) {
+         printFrames(jvmti, jni, thread->frames.data(), thread->frames.size(), out);
+      }
+   }
+
+   fprintf(out, "\nStacks unchanged: %lld\n", (long long) unchanged);
+}
+
+static void wheelInsert(ThreadTag *tag)
+{
+   jlong tick = tag->deadline / WATCHDOG_TICK_NANOS;
+   if (x_wheel_count == 0) {
+      x_wheel_tick = monotonicNanos() / WATCHDOG_TICK_NANOS;
+   }
+   if (tick < x_wheel_tick) {
+      tick = x_wheel_tick;
+   }
+
+   tag->wheel_slot = tick % WATCHDOG_WHEEL_SLOTS;
+   ThreadTag **slot = &x_wheel[tag->wheel_slot];
+   tag->wheel_prev = nullptr;
+   tag->wheel_next = *slot;
+   if (*slot != nullptr) {
+      (*slot)->wheel_prev = tag;
+   }
+   *slot = tag;
+   tag->in_wheel = true;
+   x_wheel_count++;
+}
+
+static void wheelRemove(ThreadTag *tag)
+{
+   if (!tag->in_wheel) {
+      return;
+   }
+
+   if (tag->wheel_prev != nullptr) {
+      tag->wheel_prev->wheel_next = tag->wheel_next;
+   }
+   else {
+      x_wheel[tag->wheel_slot] = tag->wheel_next;
+   }
+   if (tag->wheel_next != nullptr) {
+      tag->wheel_next->wheel_prev = tag->wheel_prev;
+   }
+   tag->wheel_next = nullptr;
+   tag->wheel_prev = nullptr;
+   tag->in_wheel = false;
+   x_wheel_count--;
+}
+
+static Overrun *findOverrun(jlong id)
+{
+   for (auto &overrun : x_overruns) {
+      if (overrun.id == id) {
+         return &overrun;
+      }
+   }
+   return nullptr;
+}
+
+// must be called with x_watchdog_lock held
+static void finishOverrun(ThreadTag *tag)
+{
+   if (tag->overrun_id == 0) {
+      return;
+   }
+
+   Overrun *overrun = findOverrun(tag->overrun_id);
+   if (overrun != nullptr) {
+      overrun->finished = monotonicNanos();
+   }
+   tag->overrun_id = 0;
+}
+
+// must be called with x_watchdog_lock held
+static void sampleOverrun(jvmtiEnv *jvmti, JNIEnv *jni, ThreadTag *tag, jlong now)
+{
+   if (tag->overrun_id == 0) {
+      if (x_overruns.size() >= MAX_OVERRUNS) {
+         x_overruns.pop_front();
+      }
+      x_overruns.emplace_back();
+      Overrun &overrun = x_overruns.back();
+      overrun.id = ++x_last_overrun_id;
+      overrun.tid = tag->tid;
+      overrun.armed_millis = tag->armed_millis;
+      overrun.timeout_millis = tag->timeout_millis;
+      overrun.deadline = tag->deadline;
+      overrun.finished = 0;
+
+      jvmtiThreadInfo info;
+      if (ok(jvmti->GetThreadInfo(tag->thread, &info))) {
+         overrun.thread_name = info.name;
+         jvmti->Deallocate((unsigned char *) info.name);
+         jni->DeleteLocalRef(info.thread_group);
+         jni->DeleteLocalRef(info.context_class_loader);
+      }
+      tag->overrun_id = overrun.id;
+   }
+
+   Overrun *overrun = findOverrun(tag->overrun_id);
+   if ((overrun == nullptr) || (overrun->samples.size() >= MAX_OVERRUN_SAMPLES)) {
+      return;
+   }
+
+   StackTrace trace;
+   if (!captureTrace(jvmti, tag, &trace)) {
+      return;
+   }
+
+   overrun->samples.emplace_back();
+   OverrunSample &sample = overrun->samples.back();
+   sample.offset = now - overrun->deadline;
+   sample.context = trace.context;
+   if (trace.num_frames > 0) {
+      sample.frames.assign(trace.frames, trace.frames + trace.num_frames);
+   }
+}
+
+// must be called with x_watchdog_lock held
+static void watchdogTick(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+   jlong now = monotonicNanos();
+   jlong now_tick = now / WATCHDOG_TICK_NANOS;
+
+   // one revolution visits every slot, so skip ticks beyond that
+   jlong first_tick = x_wheel_tick;
+   if ((now_tick - first_tick) >= WATCHDOG_WHEEL_SLOTS) {
+      first_tick = now_tick - WATCHDOG_WHEEL_SLOTS + 1;
+   }
+
+   std::vector<ThreadTag *> expired;
+   for (jlong tick = first_tick; tick <= now_tick; tick++) {
+      for (ThreadTag *tag = x_wheel[tick % WATCHDOG_WHEEL_SLOTS]; tag != nullptr; tag = tag->wheel_next) {
+         if (tag->deadline <= now) {
+            expired.push_back(tag);
+         }
+      }
+   }
+   x_wheel_tick = now_tick + 1;
+
+   for (ThreadTag *tag : expired) {
+      wheelRemove(tag);
+      sampleOverrun(jvmti, jni, tag, now);
+
+      // keep sampling until the thread disarms
+      tag->deadline = now + (deadline_interval * 1000 * 1000);
+      wheelInsert(tag);
+   }
+}
+
+static void JNICALL watchdog(jvmtiEnv *jvmti, JNIEnv *jni, void *arg)
+{
+   jvmti->RawMonitorEnter(x_watchdog_lock);
+   while (true) {
+      if (x_wheel_count == 0) {
+         jvmti->RawMonitorWait(x_watchdog_lock, 0);
+         continue;
+      }
+      jvmti->RawMonitorWait(x_watchdog_lock, WATCHDOG_TICK_NANOS / (1000 * 1000));
+      watchdogTick(jvmti, jni);
+   }
+}
+
+static void printOverruns(jvmtiEnv *jvmti, JNIEnv *jni, FILE *out)
+{
+   // copy the reports so the watchdog is not blocked by a slow client
+   jvmti->RawMonitorEnter(x_watchdog_lock);
+   std::deque<Overrun> overruns = x_overruns;
+   jvmti->RawMonitorExit(x_watchdog_lock);
+
+   jlong now = monotonicNanos();
+   for (const Overrun &overrun : overruns) {
+      char armed[32];
+      formatTime(overrun.armed_millis, armed, sizeof(armed));
+
+      jlong end = (overrun.finished != 0) ? overrun.finished : now;
+      fprintf(out,
+         "Deadline overrun #%lld: \"%s\" tid=%d\n"
+         "  armed at %s with timeout %lld ms, overran by %lld ms%s\n\n",
+         (long long) overrun.id,
+         overrun.thread_name.c_str(),
+         (int) overrun.tid,
+         armed,
+         (long long) overrun.timeout_millis,
+         (long long) ((end - overrun.deadline) / (1000 * 1000)),
+         (overrun.finished != 0) ? "" : " (still running)");
+
+      for (const OverrunSample &sample : overrun.samples) {
+         fprintf(out, "  sample at +%lld ms\n", (long long) (sample.offset / (1000 * 1000)));
+         printContext(&sample.context, out);
+         printFrames(jvmti, jni, sample.frames.data(), sample.frames.size(), out);
+         fprintf(out, "\n");
+      }
+   }
+}
+
+static uint64_t allocSiteHash(uint32_t stack_id, const std::string &class_name)
+{
+   return (stack_id * 0x9e3779b97f4a7c15ULL) ^ std::hash<std::string>()(class_name);
+}
+
+// must be called with x_profile_lock held
+static void rebuildStackTable()
+{
+   std::vector<uint32_t> remap(x_stacks.size(), UINT32_MAX);
+   std::vector<InternedStack> stacks;
+   auto keep = [&](uint32_t id) {
+      if ((id != UINT32_MAX) && (remap[id] == UINT32_MAX)) {
+         remap[id] = stacks.size();
+         stacks.push_back(std::move(x_stacks[id]));
+      }
+   };
+   for (const ProfileBucket &bucket : x_buckets) {
+      for (const auto &entry : bucket.counts) {
+         keep(entry.first);
+      }
+   }
+   for (const auto &timeline : x_timelines) {
+      for (const TimelineEntry &entry : timeline.second.entries) {
+         keep(entry.stack_id);
+      }
+   }
+   for (const AllocSite &site : x_alloc_sites) {
+      keep(site.stack_id);
+   }
+
+   x_stacks.swap(stacks);
+   x_stack_ids.clear();
+   for (uint32_t id = 0; id < x_stacks.size(); id++) {
+      uint64_t hash = x_stacks[id].hash;
+      while (x_stack_ids.count(hash) != 0) {
+         hash++;
+      }
+      x_stack_ids[hash] = id;
+   }
+   for (ProfileBucket &bucket : x_buckets) {
+      std::unordered_map<uint32_t, jlong> counts;
+      for (const auto &entry : bucket.counts) {
+         counts[remap[entry.first]] = entry.second;
+      }
+      bucket.counts.swap(counts);
+   }
+   for (auto &timeline : x_timelines) {
+      for (TimelineEntry &entry : timeline.second.entries) {
+         if (entry.stack_id != UINT32_MAX) {
+            entry.stack_id = remap[entry.stack_id];
+         }
+      }
+   }
+   x_alloc_ids.clear();
+   for (uint32_t id = 0; id < x_alloc_sites.size(); id++) {
+      AllocSite &site = x_alloc_sites[id];
+      site.stack_id = remap[site.stack_id];
+      uint64_t hash = allocSiteHash(site.stack_id, site.class_name);
+      while (x_alloc_ids.count(hash) != 0) {
+         hash++;
+      }
+      x_alloc_ids[hash] = id;
+   }
+   x_stacks_reclaimable = false;
+   x_stack_rebuilds++;
+}
+
+// must be called with x_profile_lock held, returns false if the table is full
+static bool internStack(const StackTrace *trace, bool runnable, uint32_t *id)
+{
+   uint64_t hash = hashFrames(trace->frames, trace->num_frames, runnable) ^ hashContext(trace->context);
+   uint64_t probe = hash;
+   while (true) {
+      auto found = x_stack_ids.find(probe);
+      if (found == x_stack_ids.end()) {
+         break;
+      }
+      const InternedStack &stack = x_stacks[found->second];
+      if ((stack.runnable == runnable) &&
+            (stack.context.id == trace->context.id) &&
+            (strcmp(stack.context.label, trace->context.label) == 0) &&
+            (stack.frames.size() == (size_t) trace->num_frames) &&
+            std::equal(stack.frames.begin(), stack.frames.end(), trace->frames, [](const AsyncCallFrame &a, const AsyncCallFrame &b) {
+               return (a.method == b.method) && (a.lineno == b.lineno);
+            })) {
+         *id = found->second;
+         return true;
+      }
+      probe++;
+   }
+
+   if ((x_stacks.size() >= (size_t) max_stacks) && x_stacks_reclaimable) {
+      // drop stacks only referenced by expired buckets
+      rebuildStackTable();
+      return internStack(trace, runnable, id);
+   }
+   if (x_stacks.size() >= (size_t) max_stacks) {
+      return false;
+   }
+
+   *id = x_stacks.size();
+   x_stacks.push_back({hash, runnable, trace->context, std::vector<AsyncCallFrame>(trace->frames, trace->frames + trace->num_frames)});
+   x_stack_ids[probe] = *id;
+   return true;
+}
+
+// must be called with x_profile_lock held
+static void recordTimelineSample(pid_t tid, const std::string &name, jint state, uint32_t stack_id, jlong now_millis)
+{
+   Timeline &timeline = x_timelines[tid];
+   if (!name.empty() && (timeline.name != name)) {
+      timeline.name = name;
+   }
+   TimelineEntry entry = {now_millis, state, stack_id};
+   if (timeline.entries.size() < (size_t) timeline_samples) {
+      timeline.entries.push_back(entry);
+      return;
+   }
+   timeline.entries[timeline.next] = entry;
+   timeline.next = (timeline.next + 1) % timeline.entries.size();
+}
+
+// must be called with x_profile_lock held
+static void expireTimelines(jlong now_millis)
+{
+   jlong oldest = now_millis - (history_seconds * 1000);
+   for (auto it = x_timelines.begin(); it != x_timelines.end(); ) {
+      const Timeline &timeline = it->second;
+      const TimelineEntry &newest = timeline.entries[(timeline.next + timeline.entries.size() - 1) % timeline.entries.size()];
+      if (newest.time_millis < oldest) {
+         it = x_timelines.erase(it);
+         x_stacks_reclaimable = true;
+      }
+      else {
+         ++it;
+      }
+   }
+}
+
+// The bucket of a time, or nullptr if its slot already holds a later
+// bucket. Must be called with x_profile_lock held.
+static ProfileBucket *profileBucket(jlong time_millis)
+{
+   jlong width = bucket_seconds * 1000;
+   jlong start = time_millis - (time_millis % width);
+
+   // the ring wraps around, so a bucket is reused once it has expired
+   ProfileBucket &bucket = x_buckets[(start / width) % x_buckets.size()];
+   if (bucket.start_millis > start) {
+      return nullptr;
+   }
+   if (bucket.start_millis != start) {
+      if (!bucket.counts.empty()) {
+         x_stacks_reclaimable = true;
+      }
+      bucket.start_millis = start;
+      bucket.samples = 0;
+      bucket.dropped = 0;
+      bucket.gc_pauses = 0;
+      bucket.gc_nanos = 0;
+      bucket.skipped = 0;
+      bucket.counts.clear();
+      // timelines of threads that ended before the history
+      expireTimelines(time_millis);
+   }
+   return &bucket;
+}
+
+// add the GC pauses since the last call to the buckets they started in,
+// must be called with x_profile_lock held
+static void drainGcPauses()
+{
+   std::vector<GcPause> pauses;
+   x_gc_drained = copyGcPauses(x_gc_drained, &pauses);
+   for (const GcPause &pause : pauses) {
+      ProfileBucket *bucket = profileBucket(pause.start_micros / 1000);
+      if (bucket != nullptr) {
+         bucket->gc_pauses++;
+         bucket->gc_nanos += pause.nanos;
+      }
+   }
+}
+
+static void recordProfileSample(jvmtiEnv *jvmti, const StackTrace *trace, pid_t tid, const std::string &name, jint state,
+      jlong now_millis)
+{
+   jvmti->RawMonitorEnter(x_profile_lock);
+   // nullptr only if the wall clock went back by more than the history
+   ProfileBucket *bucket = profileBucket(now_millis);
+   if (bucket == nullptr) {
+      jvmti->RawMonitorExit(x_profile_lock);
+      return;
+   }
+
+   uint32_t id;
+   bucket->samples++;
+   if (internStack(trace, (state & JVMTI_THREAD_STATE_RUNNABLE) != 0, &id)) {
+      bucket->counts[id]++;
+   }
+   else {
+      id = UINT32_MAX;
+      bucket->dropped++;
+   }
+   if (timeline_samples > 0) {
+      recordTimelineSample(tid, name, state, id, now_millis);
+   }
+
+   jvmti->RawMonitorExit(x_profile_lock);
+}
+
+// a runnable thread in the same methods is spinning if it used CPU time
+// since its stack stopped changing, and hung in I/O or native code if not
+static const char *stuckKind(jint state, jlong cpu_time)
+{
+   if (state & JVMTI_THREAD_STATE_RUNNABLE) {
+      return (cpu_time > 0) ? "spinning" : "hung";
+   }
+   if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
+      return "blocked";
+   }
+   return "waiting";
+}
+
+static jlong cpuPercent(jlong cpu_time, jlong elapsed)
+{
+   return (elapsed > 0) ? ((cpu_time * 100) / elapsed) : 0;
+}
+
+// idle threads park with an unchanging stack, so by default only threads
+// that should be making progress are considered stuck
+static bool stuckCandidate(jint state, bool all)
+{
+   return all || (state & (JVMTI_THREAD_STATE_RUNNABLE | JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER));
+}
+
+// must be called with x_trace_lock held
+static bool updateStuckState(ThreadTag *tag, const StackTrace *trace, jint state, jlong cpu_time, jlong now)
+{
+   // methods only, so that a loop in the same methods counts as unchanged
+   uint64_t fingerprint = hashMethods(trace->frames, trace->num_frames, state);
+   if ((fingerprint != tag->fingerprint) || (tag->unchanged_since == 0)) {
+      tag->fingerprint = fingerprint;
+      tag->unchanged_since = now;
+      tag->unchanged_cpu_time = cpu_time;
+      tag->stuck_reported = false;
+   }
+   tag->last_cpu_time = cpu_time;
+   tag->last_state = state;
+
+   // report each stuck episode only once
+   bool stuck = (now - tag->unchanged_since) >= (stuck_threshold * 1000 * 1000);
+   if (stuck && !tag->stuck_reported && stuckCandidate(state, false)) {
+      tag->stuck_reported = true;
+      return true;
+   }
+   return false;
+}
+
+static void sampleThread(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jlong now, jlong now_millis)
+{
+   jint state;
+   if (!ok(jvmti->GetThreadState(thread, &state))) {
+      return;
+   }
+
+   jlong cpu_time;
+   if (!cpu_time_enabled || !ok(jvmti->GetThreadCpuTime(thread, &cpu_time))) {
+      cpu_time = 0;
+   }
+
+   // the name keeps the index of findThreadByName current
+   jvmtiThreadInfo info;
+   if (!ok(jvmti->GetThreadInfo(thread, &info))) {
+      return;
+   }
+   std::string name = info.name;
+   jvmti->Deallocate((unsigned char *) info.name);
+   jni->DeleteLocalRef(info.thread_group);
+   jni->DeleteLocalRef(info.context_class_loader);
+
+   StackTrace trace;
+   bool report = false;
+   jlong stuck_millis = 0;
+   jlong stuck_cpu_time = 0;
+   jlong cpu_percent = 0;
+   bool captured = false;
+   pid_t tid = 0;
+
+   jvmti->RawMonitorEnter(x_trace_lock);
+
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      renameThread(tag, name.c_str());
+      captured = captureTrace(jvmti, tag, &trace);
+   }
+   if (captured) {
+      tid = tag->tid;
+      report = updateStuckState(tag, &trace, state, cpu_time, now);
+      jlong elapsed = now - tag->unchanged_since;
+      stuck_millis = elapsed / (1000 * 1000);
+      stuck_cpu_time = tag->last_cpu_time - tag->unchanged_cpu_time;
+      cpu_percent = cpuPercent(stuck_cpu_time, elapsed);
+   }
+
+   jvmti->RawMonitorExit(x_trace_lock);
+
+   if (captured && (trace.num_frames > 0)) {
+      recordProfileSample(jvmti, &trace, tid, name, state, now_millis);
+      if (!spool_dir.empty()) {
+         spoolSample(jvmti, jni, &trace, tid, name, state, now_millis);
+      }
+      if (!ring_file.empty()) {
+         ringSample(jvmti, jni, &trace, tid, name, state, now_millis);
+      }
+   }
+
+   if (report && stuck_log) {
+      fprintf(stderr, "WARNING: AStack: thread \"%s\" stuck for %lld ms (%s, cpu %lld%%)\n",
+         name.c_str(),
+         (long long) stuck_millis,
+         stuckKind(state, stuck_cpu_time),
+         (long long) cpu_percent);
+   }
+}
+
+static void sampleAllThreads(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+   jint count;
+   jthread *threads;
+   auto err = jvmti->GetAllThreads(&count, &threads);
+   if (!ok(err)) {
+      fprintf(stderr, "WARNING: GetAllThreads failed: %d\n", err);
+      return;
+   }
+
+   jlong now = monotonicNanos();
+   jlong now_millis = currentTimeMillis();
+   bool skipped = false;
+   for (int i = 0; i < count; i++) {
+      auto thread = threads[i];
+      // threads stopped for a GC pause cannot be walked, so the rest of
+      // the tick is skipped rather than signalling them
+      skipped = skipped || (x_gc_start_nanos.load() != 0);
+      if (!skipped) {
+         sampleThread(jvmti, jni, thread, now, now_millis);
+      }
+      jni->DeleteLocalRef(thread);
+   }
+
+   jvmti->Deallocate((unsigned char *) threads);
+
+   if (gc) {
+      jvmti->RawMonitorEnter(x_profile_lock);
+      drainGcPauses();
+      ProfileBucket *bucket = profileBucket(now_millis);
+      if (skipped && (bucket != nullptr)) {
+         bucket->skipped++;
+      }
+      jvmti->RawMonitorExit(x_profile_lock);
+   }
+}
+
+static void JNICALL sampler(jvmtiEnv *jvmti, JNIEnv *jni, void *arg)
+{
+   jlong next = monotonicNanos();
+   while (true) {
+      sampleAllThreads(jvmti, jni);
+
+      // fixed rate, but never try to catch up after a slow pass
+      next += sample_interval * 1000 * 1000;
+      jlong now = monotonicNanos();
+      if (next < now) {
+         next = now;
+      }
+      timespec delay;
+      delay.tv_sec = (next - now) / (1000 * 1000 * 1000);
+      delay.tv_nsec = (next - now) % (1000 * 1000 * 1000);
+      nanosleep(&delay, nullptr);
+   }
+}
+
+static void printStuckThreads(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (sample_interval == 0) {
+      fprintf(out, "ERROR: stuck thread detection requires the interval option\n");
+      return;
+   }
+
+   bool all = requestFlag(request, "all");
+
+   jint count;
+   jthread *threads;
+   auto err = jvmti->GetAllThreads(&count, &threads);
+   if (!ok(err)) {
+      fprintf(stderr, "WARNING: GetAllThreads failed: %d\n", err);
+      return;
+   }
+
+   jlong now = monotonicNanos();
+   for (int i = 0; i < count; i++) {
+      auto thread = threads[i];
+
+      bool stuck = false;
+      jint state = 0;
+      jlong elapsed = 0;
+      jlong cpu_time = 0;
+
+      jvmti->RawMonitorEnter(x_trace_lock);
+
+      ThreadTag *tag;
+      if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr) && (tag->unchanged_since != 0)) {
+         state = tag->last_state;
+         elapsed = now - tag->unchanged_since;
+         cpu_time = tag->last_cpu_time - tag->unchanged_cpu_time;
+         stuck = (elapsed >= (stuck_threshold * 1000 * 1000)) && stuckCandidate(state, all);
+      }
+
+      jvmti->RawMonitorExit(x_trace_lock);
+
+      ThreadSnapshot snapshot;
+      if (stuck && captureThread(jvmti, jni, thread, &snapshot)) {
+         jlong cpu_percent = cpuPercent(cpu_time, elapsed);
+         printThreadHeader(&snapshot, out);
+         fprintf(out, "  astack.stuck: %lld ms, %s, cpu %lld%%\n",
+            (long long) (elapsed / (1000 * 1000)),
+            stuckKind(state, cpu_time),
+            (long long) cpu_percent);
+         printContext(&snapshot.context, out);
+         printFrames(jvmti, jni, snapshot.frames.data(), snapshot.frames.size(), out);
+         fprintf(out, "\n");
+      }
+
+      jni->DeleteLocalRef(thread);
+   }
+
+   jvmti->Deallocate((unsigned char *) threads);
+}
+
+// Add up the buckets overlapping [from, to). Must be called with
+// x_profile_lock held.
+static void sumProfileBuckets(jlong from, jlong to, bool runnable, std::map<uint32_t, jlong> *counts, jlong *samples,
+      jlong *dropped)
+{
+   jlong width = bucket_seconds * 1000;
+   for (const ProfileBucket &bucket : x_buckets) {
+      if ((bucket.start_millis < 0) || (bucket.start_millis + width <= from) || (bucket.start_millis >= to)) {
+         continue;
+      }
+      *samples += bucket.samples;
+      *dropped += bucket.dropped;
+      for (const auto &entry : bucket.counts) {
+         if (!runnable || x_stacks[entry.first].runnable) {
+            (*counts)[entry.first] += entry.second;
+         }
+      }
+   }
+}
+
+// the time range of the last, from and to arguments, by default the
+// whole history
+static bool requestedTimeRange(const Request *request, jlong *from, jlong *to, FILE *out)
+{
+   jlong now = currentTimeMillis();
+   *from = now - (history_seconds * 1000);
+   *to = now;
+   const char *last = requestArg(request, "last");
+   const char *from_text = requestArg(request, "from");
+   const char *to_text = requestArg(request, "to");
+   jlong seconds;
+   if ((last != nullptr) && (!parseLong(last, &seconds) || (seconds <= 0))) {
+      fprintf(out, "ERROR: invalid last: %s\n", last);
+      return false;
+   }
+   if (last != nullptr) {
+      *from = now - (seconds * 1000);
+   }
+   if ((from_text != nullptr) && !parseLong(from_text, from)) {
+      fprintf(out, "ERROR: invalid from: %s\n", from_text);
+      return false;
+   }
+   if ((to_text != nullptr) && !parseLong(to_text, to)) {
+      fprintf(out, "ERROR: invalid to: %s\n", to_text);
+      return false;
+   }
+   return true;
+}
+
+static void printProfile(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (sample_interval == 0) {
+      fprintf(out, "ERROR: profile history requires the interval option\n");
+      return;
+   }
+
+   jlong from;
+   jlong to;
+   if (!requestedTimeRange(request, &from, &to, out)) {
+      return;
+   }
+   bool runnable = requestFlag(request, "runnable");
+
+   // copy the stacks while holding the lock, symbolize them afterwards
+   std::map<uint32_t, jlong> counts;
+   std::vector<std::pair<InternedStack, jlong>> stacks;
+   jlong samples = 0;
+   jlong dropped = 0;
+
+   jvmti->RawMonitorEnter(x_profile_lock);
+   sumProfileBuckets(from, to, runnable, &counts, &samples, &dropped);
+   for (const auto &entry : counts) {
+      stacks.emplace_back(x_stacks[entry.first], entry.second);
+   }
+   jvmti->RawMonitorExit(x_profile_lock);
+
+   // distinct stacks can fold to the same names
+   std::map<std::string, jlong> folded;
+   std::string stack;
+   std::vector<EmittedFrame> emitted;
+   for (const auto &entry : stacks) {
+      stack.clear();
+      appendFoldedContext(stack, entry.first.context);
+      appendFoldedFrames(jvmti, jni, entry.first.frames.data(), entry.first.frames.size(), &emitted, stack);
+      if (!stack.empty()) {
+         folded[stack] += entry.second;
+      }
+   }
+
+   if (dropped > 0) {
+      fprintf(out, "WARNING: %lld of %lld samples dropped, stack table is full\n", (long long) dropped, (long long) samples);
+   }
+   for (const auto &entry : folded) {
+      fprintf(out, "%s %lld\n", entry.first.c_str(), (long long) entry.second);
+   }
+}
+
+// GC pauses in the requested time range, then the buckets of the profile
+// history with their GC time and the ticks skipped during GC pauses
+static void printGc(jvmtiEnv *jvmti, const Request *request, FILE *out)
+{
+   if (!gc) {
+      fprintf(out, "ERROR: gc requires the gc option\n");
+      return;
+   }
+   jlong from;
+   jlong to;
+   if (!requestedTimeRange(request, &from, &to, out)) {
+      return;
+   }
+
+   std::vector<GcPause> pauses;
+   copyGcPauses(0, &pauses);
+   std::vector<GcPause> selected;
+   jlong total = 0;
+   jlong longest = 0;
+   for (const GcPause &pause : pauses) {
+      if (((pause.start_micros / 1000) >= from) && ((pause.start_micros / 1000) < to)) {
+         selected.push_back(pause);
+         total += pause.nanos;
+         longest = std::max(longest, pause.nanos);
+      }
+   }
+
+   char time[32];
+   fprintf(out, "GC: %zu pauses, %.1f ms, longest %.1f ms\n", selected.size(), total / (1000.0 * 1000), longest / (1000.0 * 1000));
+   for (const GcPause &pause : selected) {
+      formatTime(pause.start_micros / 1000, time, sizeof(time));
+      fprintf(out, "Pause at %s: %.1f ms\n", time, pause.nanos / (1000.0 * 1000));
+   }
+   if (sample_interval == 0) {
+      return;
+   }
+
+   std::vector<ProfileBucket> buckets;
+   jlong width = bucket_seconds * 1000;
+   jvmti->RawMonitorEnter(x_profile_lock);
+   drainGcPauses();
+   for (const ProfileBucket &bucket : x_buckets) {
+      if ((bucket.start_millis >= 0) && (bucket.start_millis + width > from) && (bucket.start_millis < to)) {
+         buckets.emplace_back();
+         buckets.back().start_millis = bucket.start_millis;
+         buckets.back().samples = bucket.samples;
+         buckets.back().gc_pauses = bucket.gc_pauses;
+         buckets.back().gc_nanos = bucket.gc_nanos;
+         buckets.back().skipped = bucket.skipped;
+      }
+   }
+   jvmti->RawMonitorExit(x_profile_lock);
+
+   std::sort(buckets.begin(), buckets.end(), [](const ProfileBucket &a, const ProfileBucket &b) {
+      return a.start_millis < b.start_millis;
+   });
+   for (const ProfileBucket &bucket : buckets) {
+      formatTime(bucket.start_millis, time, sizeof(time));
+      fprintf(out, "Bucket at %s: %lld samples, %lld GC pauses, %.1f ms in GC, %lld ticks skipped\n",
+         time,
+         (long long) bucket.samples,
+         (long long) bucket.gc_pauses,
+         bucket.gc_nanos / (1000.0 * 1000),
+         (long long) bucket.skipped);
+   }
+}
+
+static bool parseRange(const char *text, jlong *from, jlong *to)
+{
+   const char *colon = strchr(text, ':');
+   if (colon == nullptr) {
+      return false;
+   }
+   std::string from_text(text, colon - text);
+   return parseLong(from_text.c_str(), from) && parseLong(colon + 1, to) && (*from <= *to);
+}
+
+// the before and after windows of the profile history, by stack ID
+static bool collectHistoryDelta(jvmtiEnv *jvmti, const Request *request, std::vector<DeltaStack> *stacks,
+      jlong *before_total, jlong *after_total, jlong *dropped, jlong *time_millis, FILE *out)
+{
+   if (sample_interval == 0) {
+      fprintf(out, "ERROR: profile history requires the interval option\n");
+      return false;
+   }
+   jlong from[2];
+   jlong to[2];
+   const char *keys[2] = {"before", "after"};
+   for (int i = 0; i < 2; i++) {
+      const char *text = requestArg(request, keys[i]);
+      if (text == nullptr) {
+         fprintf(out, "ERROR: missing %s range\n", keys[i]);
+         return false;
+      }
+      if (!parseRange(text, &from[i], &to[i])) {
+         fprintf(out, "ERROR: invalid %s: %s\n", keys[i], text);
+         return false;
+      }
+   }
+   bool runnable = requestFlag(request, "runnable");
+
+   std::map<uint32_t, jlong> before;
+   std::map<uint32_t, jlong> after;
+   jvmti->RawMonitorEnter(x_profile_lock);
+   sumProfileBuckets(from[0], to[0], runnable, &before, before_total, dropped);
+   sumProfileBuckets(from[1], to[1], runnable, &after, after_total, dropped);
+
+   // merge the two sorted maps, copying the frames of each stack once
+   auto b = before.begin();
+   auto a = after.begin();
+   while ((b != before.end()) || (a != after.end())) {
+      uint32_t id = ((a == after.end()) || ((b != before.end()) && (b->first < a->first))) ? b->first : a->first;
+      stacks->emplace_back();
+      DeltaStack &stack = stacks->back();
+      stack.context = x_stacks[id].context;
+      stack.frames = x_stacks[id].frames;
+      if ((b != before.end()) && (b->first == id)) {
+         stack.before = (b++)->second;
+      }
+      if ((a != after.end()) && (a->first == id)) {
+         stack.after = (a++)->second;
+      }
+   }
+   jvmti->RawMonitorExit(x_profile_lock);
+
+   *time_millis = from[1];
+   return true;
+}
+
+// the threads of two retained snapshots, keyed by their raw frames
+static bool collectSnapshotDelta(jvmtiEnv *jvmti, const Request *request, std::vector<DeltaStack> *stacks,
+      jlong *before_total, jlong *after_total, jlong *time_millis, FILE *out)
+{
+   std::shared_ptr<const Snapshot> from;
+   std::shared_ptr<const Snapshot> to;
+   if (!requestedSnapshots(jvmti, request, &from, &to, out)) {
+      return false;
+   }
+   bool runnable = requestFlag(request, "runnable");
+
+   std::unordered_map<uint64_t, size_t> ids;
+   for (const Snapshot *snapshot : {from.get(), to.get()}) {
+      bool after = snapshot == to.get();
+      (after ? *after_total : *before_total) += snapshot->threads.size();
+      for (const ThreadSnapshot &thread : snapshot->threads) {
+         if (runnable && ((thread.state & JVMTI_THREAD_STATE_RUNNABLE) == 0)) {
+            continue;
+         }
+         uint64_t hash = hashFrames(thread.frames.data(), thread.frames.size(), 0) ^ hashContext(thread.context);
+         auto inserted = ids.emplace(hash, stacks->size());
+         if (inserted.second) {
+            stacks->emplace_back();
+            stacks->back().context = thread.context;
+            stacks->back().frames = thread.frames;
+         }
+         DeltaStack &stack = (*stacks)[inserted.first->second];
+         (after ? stack.after : stack.before)++;
+      }
+   }
+
+   *time_millis = to->time_millis;
+   return true;
+}
+
+// Profile with the samples of both windows, the before counts scaled by
+// the given factor, and their difference as the default sample type.
+// Frames are not folded, like in the profiles of astack-reader.
+static void writeDeltaPprof(jvmtiEnv *jvmti, JNIEnv *jni, const std::vector<DeltaStack> &stacks, double scale,
+      jlong time_millis, FILE *out)
+{
+   std::unordered_map<std::string, uint64_t> strings;
+   std::vector<const std::string *> string_table;
+   auto string = [&](const std::string &value) {
+      auto inserted = strings.emplace(value, strings.size());
+      if (inserted.second) {
+         string_table.push_back(&inserted.first->first);
+      }
+      return inserted.first->second;
+   };
+   string("");
+
+   ProtoWriter profile;
+   ProtoWriter message;
+   for (const char *type : {"before", "after", "delta"}) {
+      message.out.clear();
+      message.uint(1, string(type));
+      message.uint(2, string("count"));
+      profile.bytes(1, message.out);
+   }
+
+   std::unordered_map<jmethodID, uint64_t> functions;
+   std::map<std::pair<uint64_t, jint>, uint64_t> locations;
+   for (const DeltaStack &stack : stacks) {
+      jlong before = llround(stack.before * scale);
+      if ((before == 0) && (stack.after == 0)) {
+         continue;
+      }
+
+      std::vector<uint64_t> location_ids;
+      for (const AsyncCallFrame &frame : stack.frames) {
+         const MethodInfo *info = lookupMethod(jvmti, jni, frame.method);
+         auto function = functions.emplace(frame.method, functions.size() + 1);
+         if (function.second) {
+            std::string name = info->class_name + "." + info->method_name;
+            message.out.clear();
+            message.uint(1, function.first->second);
+            message.uint(2, string(name));
+            message.uint(3, string(name));
+            message.uint(4, string(info->source_name));
+            profile.bytes(5, message.out);
+         }
+
+         jint line = std::max(getLineNumber(info, frame.lineno), 0);
+         auto location = locations.emplace(std::make_pair(function.first->second, line), locations.size() + 1);
+         if (location.second) {
+            ProtoWriter line_message;
+            line_message.uint(1, function.first->second);
+            line_message.uint(2, line);
+            message.out.clear();
+            message.uint(1, location.first->second);
+            message.bytes(4, line_message.out);
+            profile.bytes(4, message.out);
+         }
+         location_ids.push_back(location.first->second);
+      }
+
+      // negative deltas are encoded as two's complement, like any int64
+      message.out.clear();
+      message.packed(1, location_ids);
+      message.packed(2, {(uint64_t) before, (uint64_t) stack.after, (uint64_t) (stack.after - before)});
+      if (stack.context.label[0] != '\0') {
+         ProtoWriter label;
+         label.uint(1, string("context"));
+         label.uint(2, string(stack.context.label));
+         message.bytes(3, label.out);
+      }
+      if (stack.context.id != 0) {
+         ProtoWriter label;
+         label.uint(1, string("context_id"));
+         label.uint(3, stack.context.id);
+         message.bytes(3, label.out);
+      }
+      profile.bytes(2, message.out);
+   }
+
+   profile.uint(9, time_millis * 1000 * 1000);
+   profile.uint(14, string("delta"));
+   for (const std::string *value : string_table) {
+      profile.bytes(6, *value);
+   }
+
+   fwrite(profile.out.data(), 1, profile.out.size(), out);
+}
+
+// Per-stack difference between two windows of the profile history, or
+// between two retained snapshots. The before counts are scaled to the
+// total sample count of the after window, so that a stack that grew
+// stands out even if the windows differ in length.
+static void printDelta(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   const char *format = requestArg(request, "format");
+   bool pprof = (format != nullptr) && (strcmp(format, "pprof") == 0);
+   if ((format != nullptr) && !pprof && (strcmp(format, "folded") != 0)) {
+      fprintf(out, "ERROR: unknown format: %s\n", format);
+      return;
+   }
+
+   std::vector<DeltaStack> stacks;
+   jlong before_total = 0;
+   jlong after_total = 0;
+   jlong dropped = 0;
+   jlong time_millis;
+   if ((requestArg(request, "before") != nullptr) || (requestArg(request, "after") != nullptr)) {
+      if (!collectHistoryDelta(jvmti, request, &stacks, &before_total, &after_total, &dropped, &time_millis, out)) {
+         return;
+      }
+   }
+   else if (!collectSnapshotDelta(jvmti, request, &stacks, &before_total, &after_total, &time_millis, out)) {
+      return;
+   }
+   double scale = (before_total > 0) ? ((double) after_total / before_total) : 1;
+
+   if (pprof) {
+      writeDeltaPprof(jvmti, jni, stacks, scale, time_millis, out);
+      return;
+   }
+
+   // distinct stacks can fold to the same names
+   std::map<std::string, std::pair<double, jlong>> folded;
+   std::string name;
+   std::vector<EmittedFrame> emitted;
+   for (const DeltaStack &stack : stacks) {
+      name.clear();
+      appendFoldedContext(name, stack.context);
+      appendFoldedFrames(jvmti, jni, stack.frames.data(), stack.frames.size(), &emitted, name);
+      if (!name.empty()) {
+         folded[name].first += stack.before * scale;
+         folded[name].second += stack.after;
+      }
+   }
+
+   if (dropped > 0) {
+      fprintf(out, "WARNING: %lld samples dropped, stack table is full\n", (long long) dropped);
+   }
+   for (const auto &entry : folded) {
+      jlong before = llround(entry.second.first);
+      if ((before != 0) || (entry.second.second != 0)) {
+         fprintf(out, "%s %lld %lld\n", entry.first.c_str(), (long long) before, (long long) entry.second.second);
+      }
+   }
+}
+
+static bool compilePattern(const char *text, regex_t *pattern)
+{
+   return regcomp(pattern, text, REG_EXTENDED) == 0;
+}
+
+// remove every match of each pattern from a thread name
+static std::string poolName(const std::string &name, const std::vector<regex_t> &patterns)
+{
+   std::string result = name;
+   for (const regex_t &pattern : patterns) {
+      std::string stripped;
+      const char *p = result.c_str();
+      int flags = 0;
+      regmatch_t match;
+      while ((*p != '\0') && (regexec(&pattern, p, 1, &match, flags) == 0)) {
+         if (match.rm_eo == match.rm_so) {
+            // keep a character after an empty match to make progress
+            stripped.append(p, match.rm_so + 1);
+            p += match.rm_so + 1;
+         }
+         else {
+            stripped.append(p, match.rm_so);
+            p += match.rm_eo;
+         }
+         flags = REG_NOTBOL;
+      }
+      stripped += p;
+      result = stripped;
+   }
+   return result.empty() ? name : result;
+}
+
+static void writeJsonString(const std::string &value, FILE *out)
+{
+   fputc('"', out);
+   for (unsigned char c : value) {
+      if ((c == '"') || (c == '\\')) {
+         fprintf(out, "\\%c", c);
+      }
+      else if (c < 0x20) {
+         fprintf(out, "\\u%04x", c);
+      }
+      else {
+         fputc(c, out);
+      }
+   }
+   fputc('"', out);
+}
+
+// node of the stackFrames tree of a trace, a method below its caller
+struct TraceFrame {
+   uint64_t parent;
+   jmethodID method;
+};
+
+// Export the timelines as Chrome trace events, which Perfetto and
+// chrome://tracing open. Each run of samples of a thread with the same
+// state and stack becomes a slice named after the state. The threads are
+// copied and written one at a time, so only the tree of stack frames
+// grows with the size of the response.
+static void printTimeline(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if ((timeline_samples == 0) || (sample_interval == 0)) {
+      fprintf(out, "ERROR: timeline requires the interval and timeline options\n");
+      return;
+   }
+
+   jlong from;
+   jlong to;
+   if (!requestedTimeRange(request, &from, &to, out)) {
+      return;
+   }
+   const char *thread_name = requestArg(request, "thread");
+
+   std::vector<std::pair<pid_t, std::string>> threads;
+   jvmti->RawMonitorEnter(x_profile_lock);
+   for (const auto &entry : x_timelines) {
+      threads.emplace_back(entry.first, entry.second.name);
+   }
+   jvmti->RawMonitorExit(x_profile_lock);
+   std::sort(threads.begin(), threads.end());
+
+   // frame IDs start at 1, with 0 as the parent of the outermost frames
+   std::map<std::pair<uint64_t, jmethodID>, uint64_t> frame_ids;
+   std::vector<TraceFrame> frames;
+   std::unordered_map<uint32_t, uint64_t> leaf_frames; // by stack ID, as of stack_rebuilds
+   jlong stack_rebuilds = -1;
+   std::vector<TimelineEntry> entries;
+   std::unordered_map<uint32_t, std::vector<AsyncCallFrame>> new_stacks;
+   int pid = getpid();
+   bool first = true;
+
+   fprintf(out, "{\"traceEvents\": [");
+   for (const auto &thread : threads) {
+      if ((thread_name != nullptr) && (thread.second != thread_name) && (poolName(thread.second, pool_patterns) != thread_name)) {
+         continue;
+      }
+
+      // copy the entries in time order, and the frames of unseen stacks
+      entries.clear();
+      new_stacks.clear();
+      jvmti->RawMonitorEnter(x_profile_lock);
+      if (stack_rebuilds != x_stack_rebuilds) {
+         // the stack table was rebuilt since the last thread
+         leaf_frames.clear();
+         stack_rebuilds = x_stack_rebuilds;
+      }
+      auto found = x_timelines.find(thread.first);
+      if (found != x_timelines.end()) {
+         const Timeline &timeline = found->second;
+         for (size_t i = 0; i < timeline.entries.size(); i++) {
+            const TimelineEntry &entry = timeline.entries[(timeline.next + i) % timeline.entries.size()];
+            if ((entry.time_millis < from) || (entry.time_millis >= to)) {
+               continue;
+            }
+            entries.push_back(entry);
+            if ((entry.stack_id != UINT32_MAX) && (leaf_frames.count(entry.stack_id) == 0)) {
+               new_stacks.emplace(entry.stack_id, x_stacks[entry.stack_id].frames);
+            }
+         }
+      }
+      jvmti->RawMonitorExit(x_profile_lock);
+      if (entries.empty()) {
+         continue;
+      }
+
+      for (const auto &stack : new_stacks) {
+         uint64_t parent = 0;
+         for (auto frame = stack.second.rbegin(); frame != stack.second.rend(); ++frame) {
+            auto inserted = frame_ids.emplace(std::make_pair(parent, frame->method), frames.size() + 1);
+            if (inserted.second) {
+               frames.push_back({parent, frame->method});
+            }
+            parent = inserted.first->second;
+         }
+         leaf_frames[stack.first] = parent;
+      }
+
+      fprintf(out, "%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ",
+         first ? "" : ",", pid, thread.first);
+      writeJsonString(thread.second, out);
+      fprintf(out, "}}");
+      first = false;
+
+      // a run ends at a change or at a gap, such as a missed sample
+      size_t start = 0;
+      for (size_t i = 0; i < entries.size(); i++) {
+         bool last = (i + 1) == entries.size();
+         bool gap = !last && ((entries[i + 1].time_millis - entries[i].time_millis) > (2 * sample_interval));
+         if (!last && !gap && (entries[i + 1].state == entries[start].state) && (entries[i + 1].stack_id == entries[start].stack_id)) {
+            continue;
+         }
+         jlong end = (last || gap) ? (entries[i].time_millis + sample_interval) : entries[i + 1].time_millis;
+         const TimelineEntry &run = entries[start];
+         fprintf(out, ",\n  {\"name\": \"%s\", \"cat\": \"state\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, \"pid\": %d, \"tid\": %d",
+            threadStateEnum(run.state),
+            (long long) (run.time_millis * 1000),
+            (long long) ((end - run.time_millis) * 1000),
+            pid,
+            thread.first);
+         if (run.stack_id != UINT32_MAX) {
+            uint64_t leaf = leaf_frames[run.stack_id];
+            const MethodInfo *info = lookupMethod(jvmti, jni, frames[leaf - 1].method);
+            fprintf(out, ", \"sf\": %llu, \"args\": {\"frame\": ", (unsigned long long) leaf);
+            writeJsonString(info->class_name + "." + info->method_name, out);
+            fprintf(out, ", \"samples\": %zu}", i + 1 - start);
+         }
+         fprintf(out, "}");
+         start = i + 1;
+      }
+   }
+
+   // GC pauses on a track of their own
+   if (gc) {
+      std::vector<GcPause> pauses;
+      copyGcPauses(0, &pauses);
+      fprintf(out, "%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"GC\"}}",
+         first ? "" : ",", pid);
+      for (const GcPause &pause : pauses) {
+         if (((pause.start_micros / 1000) < from) || ((pause.start_micros / 1000) >= to)) {
+            continue;
+         }
+         fprintf(out, ",\n  {\"name\": \"GC pause\", \"cat\": \"gc\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, \"pid\": %d, \"tid\": 0}",
+            (long long) pause.start_micros,
+            (long long) (pause.nanos / 1000),
+            pid);
+      }
+   }
+
+   fprintf(out, "\n], \"stackFrames\": {");
+   for (size_t i = 0; i < frames.size(); i++) {
+      const MethodInfo *info = lookupMethod(jvmti, jni, frames[i].method);
+      fprintf(out, "%s\n  \"%zu\": {\"name\": ", (i == 0) ? "" : ",", i + 1);
+      writeJsonString(info->class_name + "." + info->method_name, out);
+      fprintf(out, ", \"category\": \"java\"");
+      if (frames[i].parent != 0) {
+         fprintf(out, ", \"parent\": \"%llu\"", (unsigned long long) frames[i].parent);
+      }
+      fprintf(out, "}");
+   }
+   fprintf(out, "\n}, \"displayTimeUnit\": \"ms\"}\n");
+}
+
+static int lockHistogramBucket(jlong nanos)
+{
+   int bucket = 0;
+   for (jlong limit = 1000 * 1000; (bucket < (LOCK_HISTOGRAM_BUCKETS - 1)) && (nanos >= limit); limit *= 10) {
+      bucket++;
+   }
+   return bucket;
+}
+
+// Whether to record an event that blocked for the given time, and its
+// weight. Events longer than the threshold always are. Shorter ones add
+// up, and one of them is recorded for each threshold of their total. The
+// recorded time stays right, while the number of captured stacks is
+// bounded by the blocked time.
+static bool sampleLockEvent(LockProfile *profile, jlong nanos, bool timed_out, jlong threshold, jlong *weight)
+{
+   profile->events++;
+   profile->nanos += nanos;
+   profile->timed_out += timed_out ? 1 : 0;
+   profile->histogram[lockHistogramBucket(nanos)]++;
+
+   if (nanos >= threshold) {
+      *weight = nanos;
+      return true;
+   }
+   if ((profile->pending.fetch_add(nanos) + nanos) < threshold) {
+      return false;
+   }
+   profile->pending.fetch_sub(threshold);
+   *weight = threshold;
+   return true;
+}
+
+static std::string className(jvmtiEnv *jvmti, jclass clazz)
+{
+   std::string name = "Unknown";
+   char *signature;
+   if ((clazz != nullptr) && ok(jvmti->GetClassSignature(clazz, &signature, nullptr))) {
+      fixClassSignature(signature);
+      name = signature;
+      jvmti->Deallocate((unsigned char *) signature);
+   }
+   return name;
+}
+
+static std::string objectClassName(jvmtiEnv *jvmti, JNIEnv *jni, jobject object)
+{
+   jclass clazz = jni->GetObjectClass(object);
+   std::string name = className(jvmti, clazz);
+   jni->DeleteLocalRef(clazz);
+   return name;
+}
+
+// add the stack of the current thread, blocked on the object
+static void recordLockEvent(jvmtiEnv *jvmti, JNIEnv *jni, LockProfile *profile, ThreadTag *tag, jobject object, jlong weight,
+      jlong nanos, bool timed_out)
+{
+   StackTrace trace;
+   captureOwnTrace(jni, tag, &trace);
+   std::string lock_class = objectClassName(jvmti, jni, object);
+   uint64_t hash = hashFrames(trace.frames, trace.num_frames, 0) ^ std::hash<std::string>()(lock_class);
+
+   jvmti->RawMonitorEnter(x_lock_profile_lock);
+   uint64_t probe = hash;
+   while (true) {
+      auto found = profile->ids.find(probe);
+      if (found == profile->ids.end()) {
+         break;
+      }
+      LockSite &site = profile->sites[found->second];
+      if ((site.lock_class == lock_class) &&
+            (site.frames.size() == (size_t) trace.num_frames) &&
+            std::equal(site.frames.begin(), site.frames.end(), trace.frames, [](const AsyncCallFrame &a, const AsyncCallFrame &b) {
+               return (a.method == b.method) && (a.lineno == b.lineno);
+            })) {
+         site.nanos += weight;
+         site.events++;
+         site.timed_out += timed_out ? 1 : 0;
+         site.histogram[lockHistogramBucket(nanos)]++;
+         jvmti->RawMonitorExit(x_lock_profile_lock);
+         return;
+      }
+      probe++;
+   }
+
+   if (profile->sites.size() >= (size_t) max_stacks) {
+      profile->dropped++;
+   }
+   else {
+      profile->ids[probe] = profile->sites.size();
+      profile->sites.push_back({lock_class, std::vector<AsyncCallFrame>(trace.frames, trace.frames + trace.num_frames), weight, 1,
+         timed_out ? 1 : 0, {}});
+      profile->sites.back().histogram[lockHistogramBucket(nanos)]++;
+   }
+   jvmti->RawMonitorExit(x_lock_profile_lock);
+}
+
+// copy the sites, and with reset=true start the profile over
+static std::vector<LockSite> copyLockSites(jvmtiEnv *jvmti, const Request *request, LockProfile *profile, jlong *dropped)
+{
+   std::vector<LockSite> sites;
+   jvmti->RawMonitorEnter(x_lock_profile_lock);
+   *dropped = profile->dropped;
+   if (requestFlag(request, "reset")) {
+      sites.swap(profile->sites);
+      profile->ids.clear();
+      profile->dropped = 0;
+   }
+   else {
+      sites = profile->sites;
+   }
+   jvmti->RawMonitorExit(x_lock_profile_lock);
+   return sites;
+}
+
+// Folded stacks with the lock class as the innermost frame, and the
+// blocked time in microseconds. With reset=true, the profile starts over.
+static void printLockProfile(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, LockProfile *profile, FILE *out)
+{
+   jlong dropped;
+   std::vector<LockSite> sites = copyLockSites(jvmti, request, profile, &dropped);
+
+   // distinct stacks can fold to the same names
+   std::map<std::string, jlong> folded;
+   std::string stack;
+   std::vector<EmittedFrame> emitted;
+   for (const LockSite &site : sites) {
+      stack.clear();
+      appendFoldedFrames(jvmti, jni, site.frames.data(), site.frames.size(), &emitted, stack);
+      stack += stack.empty() ? "[" : ";[";
+      appendFoldedName(stack, site.lock_class.c_str());
+      stack += ']';
+      folded[stack] += site.nanos;
+   }
+
+   if (dropped > 0) {
+      fprintf(out, "WARNING: %lld events dropped, stack table is full\n", (long long) dropped);
+   }
+   for (const auto &entry : folded) {
+      fprintf(out, "%s %lld\n", entry.first.c_str(), (long long) (entry.second / 1000));
+   }
+}
+
+static void printContention(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (!contention) {
+      fprintf(out, "ERROR: contention requires the contention option\n");
+      return;
+   }
+   printLockProfile(jvmti, jni, request, &x_contention, out);
+}
+
+static void printLockHistogram(const std::atomic<jlong> *atomic_histogram, const jlong *histogram, FILE *out)
+{
+   static const char *const labels[LOCK_HISTOGRAM_BUCKETS] = {"<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s"};
+   fprintf(out, " ");
+   for (int i = 0; i < LOCK_HISTOGRAM_BUCKETS; i++) {
+      jlong count = (atomic_histogram != nullptr) ? atomic_histogram[i].load() : histogram[i];
+      fprintf(out, " %s %lld", labels[i], (long long) count);
+   }
+   fprintf(out, "\n");
+}
+
+// Total Object.wait time and a histogram of all waits, then the sites
+// with the most wait time. Sites only count their captured waits.
+static void printWaitReport(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   jlong top = 10;
+   const char *top_text = requestArg(request, "top");
+   if ((top_text != nullptr) && (!parseLong(top_text, &top) || (top < 0))) {
+      fprintf(out, "ERROR: invalid top: %s\n", top_text);
+      return;
+   }
+
+   fprintf(out, "Object.wait: %lld waits, %lld timed out, %lld ms\n",
+      (long long) x_waits.events.load(),
+      (long long) x_waits.timed_out.load(),
+      (long long) (x_waits.nanos.load() / (1000 * 1000)));
+   printLockHistogram(x_waits.histogram, nullptr, out);
+   if (requestFlag(request, "reset")) {
+      x_waits.events = 0;
+      x_waits.nanos = 0;
+      x_waits.timed_out = 0;
+      for (std::atomic<jlong> &count : x_waits.histogram) {
+         count = 0;
+      }
+   }
+
+   jlong dropped;
+   std::vector<LockSite> sites = copyLockSites(jvmti, request, &x_waits, &dropped);
+   if (dropped > 0) {
+      fprintf(out, "WARNING: %lld waits dropped, stack table is full\n", (long long) dropped);
+   }
+   std::sort(sites.begin(), sites.end(), [](const LockSite &a, const LockSite &b) {
+      return a.nanos > b.nanos;
+   });
+   for (size_t i = 0; (i < sites.size()) && (i < (size_t) top); i++) {
+      const LockSite &site = sites[i];
+      fprintf(out, "\nWait site #%zu: %s, %lld ms in %lld captured waits, %lld timed out\n",
+         i + 1,
+         site.lock_class.c_str(),
+         (long long) (site.nanos / (1000 * 1000)),
+         (long long) site.events,
+         (long long) site.timed_out);
+      printLockHistogram(nullptr, site.histogram, out);
+      printFrames(jvmti, jni, site.frames.data(), site.frames.size(), out);
+   }
+}
+
+static void printWaits(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (!waits) {
+      fprintf(out, "ERROR: waits requires the waits option\n");
+      return;
+   }
+   const char *format = requestArg(request, "format");
+   if ((format != nullptr) && (strcmp(format, "folded") == 0)) {
+      printLockProfile(jvmti, jni, request, &x_waits, out);
+   }
+   else if ((format == nullptr) || (strcmp(format, "text") == 0)) {
+      printWaitReport(jvmti, jni, request, out);
+   }
+   else {
+      fprintf(out, "ERROR: unknown format: %s\n", format);
+   }
+}
+
+// Add a sampled allocation of the current thread. The JVM samples
+// allocations at a mean interval of alloc_interval bytes, so an object of
+// the given size was sampled with probability 1 - exp(-size / interval),
+// and each sample stands for the inverse of that in bytes.
+static void recordAllocation(jvmtiEnv *jvmti, JNIEnv *jni, ThreadTag *tag, jclass clazz, jlong size)
+{
+   StackTrace trace;
+   captureOwnTrace(jni, tag, &trace);
+   std::string class_name = className(jvmti, clazz);
+
+   double scale = (size > 0) ? (1 / (1 - exp(-((double) size / alloc_interval)))) : 1;
+   jlong objects = llround(scale);
+   jlong bytes = llround(size * scale);
+
+   jvmti->RawMonitorEnter(x_profile_lock);
+   uint32_t stack_id;
+   if (!internStack(&trace, true, &stack_id)) {
+      x_alloc_dropped++;
+      jvmti->RawMonitorExit(x_profile_lock);
+      return;
+   }
+   uint64_t probe = allocSiteHash(stack_id, class_name);
+   while (true) {
+      auto found = x_alloc_ids.find(probe);
+      if (found == x_alloc_ids.end()) {
+         break;
+      }
+      AllocSite &site = x_alloc_sites[found->second];
+      if ((site.stack_id == stack_id) && (site.class_name == class_name)) {
+         site.samples++;
+         site.objects += objects;
+         site.bytes += bytes;
+         jvmti->RawMonitorExit(x_profile_lock);
+         return;
+      }
+      probe++;
+   }
+   x_alloc_ids[probe] = x_alloc_sites.size();
+   x_alloc_sites.push_back({stack_id, class_name, 1, objects, bytes});
+   jvmti->RawMonitorExit(x_profile_lock);
+}
+
+// Folded stacks with the allocated class as the innermost frame, and the
+// estimated bytes, or with value=objects the estimated number of objects,
+// or with value=samples the number of samples. With reset=true, the
+// profile starts over.
+static void printAllocations(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (alloc_interval == 0) {
+      fprintf(out, "ERROR: allocations requires the alloc_interval option\n");
+      return;
+   }
+   const char *value = requestArg(request, "value");
+   if ((value != nullptr) &&
+         (strcmp(value, "bytes") != 0) &&
+         (strcmp(value, "objects") != 0) &&
+         (strcmp(value, "samples") != 0)) {
+      fprintf(out, "ERROR: unknown value: %s\n", value);
+      return;
+   }
+
+   // copy the sites with their frames, so that the methods are looked up
+   // without holding x_profile_lock
+   std::vector<std::pair<InternedStack, AllocSite>> sites;
+   jvmti->RawMonitorEnter(x_profile_lock);
+   jlong dropped = x_alloc_dropped;
+   for (const AllocSite &site : x_alloc_sites) {
+      sites.emplace_back(x_stacks[site.stack_id], site);
+   }
+   if (requestFlag(request, "reset")) {
+      x_stacks_reclaimable = x_stacks_reclaimable || !x_alloc_sites.empty();
+      x_alloc_sites.clear();
+      x_alloc_ids.clear();
+      x_alloc_dropped = 0;
+   }
+   jvmti->RawMonitorExit(x_profile_lock);
+
+   // distinct stacks can fold to the same names
+   std::map<std::string, jlong> folded;
+   std::string stack;
+   std::vector<EmittedFrame> emitted;
+   for (const auto &entry : sites) {
+      const AllocSite &site = entry.second;
+      stack.clear();
+      appendFoldedContext(stack, entry.first.context);
+      appendFoldedFrames(jvmti, jni, entry.first.frames.data(), entry.first.frames.size(), &emitted, stack);
+      stack += stack.empty() ? "[" : ";[";
+      appendFoldedName(stack, site.class_name.c_str());
+      stack += ']';
+      if ((value == nullptr) || (strcmp(value, "bytes") == 0)) {
+         folded[stack] += site.bytes;
+      }
+      else {
+         folded[stack] += (strcmp(value, "objects") == 0) ? site.objects : site.samples;
+      }
+   }
+
+   if (dropped > 0) {
+      fprintf(out, "WARNING: %lld samples dropped, stack table is full\n", (long long) dropped);
+   }
+   for (const auto &entry : folded) {
+      fprintf(out, "%s %lld\n", entry.first.c_str(), (long long) entry.second);
+   }
+}
+
+// ID of the class of an exception, tagged on the class so that repeated
+// throws need no lookup of its name
+static uint32_t exceptionClassId(jvmtiEnv *jvmti, JNIEnv *jni, jobject exception)
+{
+   jclass clazz = jni->GetObjectClass(exception);
+   jlong tag = 0;
+   if ((clazz == nullptr) || !ok(jvmti->GetTag(clazz, &tag)) || (tag == 0)) {
+      std::string name = className(jvmti, clazz);
+      jvmti->RawMonitorEnter(x_exception_lock);
+      auto inserted = x_exception_class_ids.emplace(name, x_exception_classes.size());
+      if (inserted.second) {
+         x_exception_classes.push_back(name);
+      }
+      tag = inserted.first->second + 1;
+      jvmti->RawMonitorExit(x_exception_lock);
+      if (clazz != nullptr) {
+         jvmti->SetTag(clazz, tag);
+      }
+   }
+   jni->DeleteLocalRef(clazz);
+   return tag - 1;
+}
+
+// must be called with x_exception_lock held, returns nullptr if the site
+// is not found and not created
+static ExceptionSite *findExceptionSite(uint32_t class_id, jmethodID method, jlocation location, bool create)
+{
+   uint64_t probe = (((uint64_t) (uintptr_t) method * 31 + location) * 0x9e3779b97f4a7c15ULL) ^ class_id;
+   while (true) {
+      auto found = x_exception_ids.find(probe);
+      if (found == x_exception_ids.end()) {
+         break;
+      }
+      ExceptionSite &site = x_exception_sites[found->second];
+      if ((site.class_id == class_id) && (site.method == method) && (site.location == location)) {
+         return &site;
+      }
+      probe++;
+   }
+   if (!create || (x_exception_sites.size() >= (size_t) max_stacks)) {
+      return nullptr;
+   }
+   x_exception_ids[probe] = x_exception_sites.size();
+   x_exception_sites.push_back({class_id, method, location, 0, 0, 0, {}});
+   return &x_exception_sites.back();
+}
+
+static double decayedExceptionRate(const ExceptionSite &site, jlong now)
+{
+   return site.rate * exp(-(double) (now - site.rate_nanos) / EXCEPTION_RATE_NANOS);
+}
+
+// Count a throw, and sample its stack while the token bucket of
+// exception_samples per second, with a burst of as many, has a token.
+static void recordException(jvmtiEnv *jvmti, JNIEnv *jni, ThreadTag *tag, jmethodID method, jlocation location, jobject exception)
+{
+   uint32_t class_id = exceptionClassId(jvmti, jni, exception);
+   jlong now = monotonicNanos();
+
+   jvmti->RawMonitorEnter(x_exception_lock);
+   x_exceptions_thrown++;
+   ExceptionSite *site = findExceptionSite(class_id, method, location, true);
+   if (site == nullptr) {
+      x_exceptions_dropped++;
+      jvmti->RawMonitorExit(x_exception_lock);
+      return;
+   }
+   site->thrown++;
+   site->rate = decayedExceptionRate(*site, now) + ((1000.0 * 1000 * 1000) / EXCEPTION_RATE_NANOS);
+   site->rate_nanos = now;
+
+   x_exception_tokens = std::min((double) exception_samples,
+      x_exception_tokens + ((now - x_exception_refill_nanos) * exception_samples / (1000.0 * 1000 * 1000)));
+   x_exception_refill_nanos = now;
+   bool sampled = x_exception_tokens >= 1;
+   if (sampled) {
+      x_exception_tokens--;
+      x_exceptions_sampled++;
+   }
+   else {
+      x_exceptions_limited++;
+   }
+   jvmti->RawMonitorExit(x_exception_lock);
+   if (!sampled) {
+      return;
+   }
+
+   StackTrace trace;
+   captureOwnTrace(jni, tag, &trace);
+
+   jvmti->RawMonitorEnter(x_exception_lock);
+   // the site is gone if the profile was reset in between
+   site = findExceptionSite(class_id, method, location, false);
+   if (site != nullptr) {
+      auto found = std::find_if(site->stacks.begin(), site->stacks.end(), [&](const ExceptionStack &stack) {
+         return (stack.frames.size() == (size_t) trace.num_frames) &&
+            std::equal(stack.frames.begin(), stack.frames.end(), trace.frames, [](const AsyncCallFrame &a, const AsyncCallFrame &b) {
+               return (a.method == b.method) && (a.lineno == b.lineno);
+            });
+      });
+      if (found != site->stacks.end()) {
+         found->samples++;
+      }
+      else if (site->stacks.size() < MAX_EXCEPTION_SITE_STACKS) {
+         site->stacks.push_back({std::vector<AsyncCallFrame>(trace.frames, trace.frames + trace.num_frames), 1});
+      }
+   }
+   jvmti->RawMonitorExit(x_exception_lock);
+}
+
+// Throw sites ranked by their current rate, each with its most sampled
+// stack, or with format=folded the sampled stacks with the exception class
+// as the innermost frame. enable=true|false turns the Exception event on
+// or off, and reset=true starts over.
+static void printExceptions(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (!exceptions) {
+      fprintf(out, "ERROR: exceptions requires the exceptions option\n");
+      return;
+   }
+   const char *format = requestArg(request, "format");
+   bool folded = (format != nullptr) && (strcmp(format, "folded") == 0);
+   if ((format != nullptr) && !folded && (strcmp(format, "text") != 0)) {
+      fprintf(out, "ERROR: unknown format: %s\n", format);
+      return;
+   }
+   jlong top = 10;
+   const char *top_text = requestArg(request, "top");
+   if ((top_text != nullptr) && (!parseLong(top_text, &top) || (top < 0))) {
+      fprintf(out, "ERROR: invalid top: %s\n", top_text);
+      return;
+   }
+   const char *enable_text = requestArg(request, "enable");
+   if (enable_text != nullptr) {
+      bool enable;
+      if (!parseBool(enable_text, &enable)) {
+         fprintf(out, "ERROR: invalid enable: %s\n", enable_text);
+         return;
+      }
+      jvmtiError err = jvmti->SetEventNotificationMode(enable ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_EXCEPTION, nullptr);
+      if (!ok(err)) {
+         fprintf(out, "ERROR: SetEventNotificationMode failed: %d\n", err);
+         return;
+      }
+      x_exceptions_enabled = enable;
+   }
+
+   jlong now = monotonicNanos();
+   jvmti->RawMonitorEnter(x_exception_lock);
+   std::vector<ExceptionSite> sites = x_exception_sites;
+   std::vector<std::string> classes = x_exception_classes;
+   jlong thrown = x_exceptions_thrown;
+   jlong sampled = x_exceptions_sampled;
+   jlong limited = x_exceptions_limited;
+   jlong dropped = x_exceptions_dropped;
+   if (requestFlag(request, "reset")) {
+      // class IDs stay valid, since they are tagged on the classes
+      x_exception_sites.clear();
+      x_exception_ids.clear();
+      x_exceptions_thrown = 0;
+      x_exceptions_sampled = 0;
+      x_exceptions_limited = 0;
+      x_exceptions_dropped = 0;
+   }
+   jvmti->RawMonitorExit(x_exception_lock);
+
+   if (dropped > 0) {
+      fprintf(out, "WARNING: %lld throws dropped, site table is full\n", (long long) dropped);
+   }
+
+   if (folded) {
+      // distinct stacks can fold to the same names
+      std::map<std::string, jlong> stacks;
+      std::string stack;
+      std::vector<EmittedFrame> emitted;
+      for (const ExceptionSite &site : sites) {
+         for (const ExceptionStack &sample : site.stacks) {
+            stack.clear();
+            appendFoldedFrames(jvmti, jni, sample.frames.data(), sample.frames.size(), &emitted, stack);
+            stack += stack.empty() ? "[" : ";[";
+            appendFoldedName(stack, classes[site.class_id].c_str());
+            stack += ']';
+            stacks[stack] += sample.samples;
+         }
+      }
+      for (const auto &entry : stacks) {
+         fprintf(out, "%s %lld\n", entry.first.c_str(), (long long) entry.second);
+      }
+      return;
+   }
+
+   fprintf(out, "Exceptions: %lld thrown, %lld stacks sampled, %lld over the sampling rate, %s\n",
+      (long long) thrown,
+      (long long) sampled,
+      (long long) limited,
+      x_exceptions_enabled ? "enabled" : "disabled");
+
+   std::vector<std::pair<double, const ExceptionSite *>> ranked;
+   for (const ExceptionSite &site : sites) {
+      ranked.emplace_back(decayedExceptionRate(site, now), &site);
+   }
+   std::sort(ranked.begin(), ranked.end(), [](const std::pair<double, const ExceptionSite *> &a, const std::pair<double, const ExceptionSite *> &b) {
+      return a.first > b.first;
+   });
+   for (size_t i = 0; (i < ranked.size()) && (i < (size_t) top); i++) {
+      const ExceptionSite &site = *ranked[i].second;
+      fprintf(out, "\nThrow site #%zu: %s, %.1f/s, %lld thrown\n",
+         i + 1,
+         classes[site.class_id].c_str(),
+         ranked[i].first,
+         (long long) site.thrown);
+      printCallFrame(jvmti, jni, site.method, (jint) site.location, out);
+
+      auto most = std::max_element(site.stacks.begin(), site.stacks.end(), [](const ExceptionStack &a, const ExceptionStack &b) {
+         return a.samples < b.samples;
+      });
+      if (most != site.stacks.end()) {
+         fprintf(out, "  most sampled stack (%lld samples):\n", (long long) most->samples);
+         printFrames(jvmti, jni, most->frames.data(), most->frames.size(), out);
+      }
+   }
+}
+
+static void printPools(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   jlong top = 3;
+   const char *top_text = requestArg(request, "top");
+   if ((top_text != nullptr) && (!parseLong(top_text, &top) || (top < 0))) {
+      fprintf(out, "ERROR: invalid top: %s\n", top_text);
+      return;
+   }
+
+   const char *sort = requestArg(request, "sort") ?: "count";
+   bool by_cpu = strcmp(sort, "cpu") == 0;
+   if (!by_cpu && (strcmp(sort, "count") != 0)) {
+      fprintf(out, "ERROR: invalid sort: %s\n", sort);
+      return;
+   }
+
+   std::vector<regex_t> request_patterns;
+   const char *pattern_text = requestArg(request, "pattern");
+   if (pattern_text != nullptr) {
+      request_patterns.emplace_back();
+      if (!compilePattern(pattern_text, &request_patterns.back())) {
+         fprintf(out, "ERROR: invalid pattern: %s\n", pattern_text);
+         return;
+      }
+   }
+   const std::vector<regex_t> &patterns = request_patterns.empty() ? pool_patterns : request_patterns;
+
+   auto snapshot = requestSnapshot(jvmti, jni, request, nullptr, out);
+   if (snapshot == nullptr) {
+      for (regex_t &pattern : request_patterns) {
+         regfree(&pattern);
+      }
+      return;
+   }
+
+   struct PoolStack {
+      const ThreadSnapshot *thread;
+      jlong count;
+      jlong cpu_time;
+   };
+
+   struct Pool {
+      std::string name;
+      jlong count = 0;
+      jlong cpu_time = 0;
+      std::map<std::string, jlong> states;
+      std::unordered_map<uint64_t, PoolStack> stacks;
+   };
+
+   std::unordered_map<std::string, Pool> pools;
+   for (const ThreadSnapshot &thread : snapshot->threads) {
+      std::string name = poolName(thread.name, patterns);
+      Pool &pool = pools[name];
+      pool.name = name;
+      pool.count++;
+      pool.cpu_time += thread.cpu_time;
+      pool.states[threadStateEnum(thread.state)]++;
+
+      // identical raw stacks are grouped before anything is symbolized
+      uint64_t fingerprint = hashFrames(thread.frames.data(), thread.frames.size(), 0);
+      PoolStack &stack = pool.stacks.emplace(fingerprint, PoolStack { &thread, 0, 0 }).first->second;
+      stack.count++;
+      stack.cpu_time += thread.cpu_time;
+   }
+
+   for (regex_t &pattern : request_patterns) {
+      regfree(&pattern);
+   }
+
+   std::vector<Pool *> sorted;
+   for (auto &entry : pools) {
+      sorted.push_back(&entry.second);
+   }
+   std::sort(sorted.begin(), sorted.end(), [by_cpu](const Pool *a, const Pool *b) {
+      if (by_cpu && (a->cpu_time != b->cpu_time)) {
+         return a->cpu_time > b->cpu_time;
+      }
+      if (a->count != b->count) {
+         return a->count > b->count;
+      }
+      return a->name < b->name;
+   });
+
+   for (const Pool *pool : sorted) {
+      fprintf(out, "Pool \"%s\": %lld threads, cpu %lld ms\n",
+         pool->name.c_str(),
+         (long long) pool->count,
+         (long long) (pool->cpu_time / (1000 * 1000)));
+      for (const auto &state : pool->states) {
+         fprintf(out, "  %s: %lld\n", state.first.c_str(), (long long) state.second);
+      }
+      fprintf(out, "\n");
+
+      std::vector<const PoolStack *> stacks;
+      for (const auto &entry : pool->stacks) {
+         stacks.push_back(&entry.second);
+      }
+      std::sort(stacks.begin(), stacks.end(), [by_cpu](const PoolStack *a, const PoolStack *b) {
+         if (by_cpu && (a->cpu_time != b->cpu_time)) {
+            return a->cpu_time > b->cpu_time;
+         }
+         return a->count > b->count;
+      });
+      if (stacks.size() > (size_t) top) {
+         stacks.resize(top);
+      }
+
+      for (const PoolStack *stack : stacks) {
+         fprintf(out, "  %lld threads, cpu %lld ms\n",
+            (long long) stack->count,
+            (long long) (stack->cpu_time / (1000 * 1000)));
+         printFrames(jvmti, jni, stack->thread->frames.data(), stack->thread->frames.size(), out);
+         fprintf(out, "\n");
+      }
+   }
+}
+
+static void printTreeNode(jvmtiEnv *jvmti, JNIEnv *jni, const std::vector<TreeNode> &nodes, int index, int depth, FILE *out)
+{
+   std::string indent(depth * 2, ' ');
+   const TreeNode *node = &nodes[index];
+
+   // the states are the same along a chain, so print them at its start
+   fprintf(out, "%s- [%lld] ", indent.c_str(), (long long) node->count);
+   printEmittedFrameText(jvmti, jni, node->frame, out);
+   fprintf(out, " {");
+   const char *separator = "";
+   for (const auto &state : node->states) {
+      fprintf(out, "%s%s: %lld", separator, state.first, (long long) state.second);
+      separator = ", ";
+   }
+   fprintf(out, "}\n");
+
+   // frames shared by all threads of this node are printed once, in line
+   while ((node->children.size() == 1) && (nodes[node->children.begin()->second].count == node->count)) {
+      node = &nodes[node->children.begin()->second];
+      fprintf(out, "%s  [%lld] ", indent.c_str(), (long long) node->count);
+      printEmittedFrameText(jvmti, jni, node->frame, out);
+      fprintf(out, "\n");
+   }
+
+   std::vector<int> children;
+   for (const auto &child : node->children) {
+      children.push_back(child.second);
+   }
+   std::sort(children.begin(), children.end(), [&nodes](int a, int b) {
+      return nodes[a].count > nodes[b].count;
+   });
+   for (int child : children) {
+      printTreeNode(jvmti, jni, nodes, child, depth + 1, out);
+   }
+}
+
+static void printCallTree(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   auto snapshot = requestSnapshot(jvmti, jni, request, nullptr, out);
+   if (snapshot == nullptr) {
+      return;
+   }
+
+   // node zero is a synthetic root above the thread entry frames
+   std::vector<TreeNode> nodes(1);
+   std::vector<EmittedFrame> emitted;
+   jlong without_frames = 0;
+   for (const ThreadSnapshot &thread : snapshot->threads) {
+      foldFrames(jvmti, jni, thread.frames.data(), thread.frames.size(), &emitted);
+      if (emitted.empty()) {
+         without_frames++;
+         continue;
+      }
+
+      const char *state = threadStateEnum(thread.state);
+      int index = 0;
+      nodes[0].count++;
+      for (int i = emitted.size() - 1; i >= 0; i--) {
+         const EmittedFrame &frame = emitted[i];
+         auto key = std::make_pair(frame.method, frame.lineno);
+         auto found = nodes[index].children.find(key);
+         int child;
+         if (found != nodes[index].children.end()) {
+            child = found->second;
+         }
+         else {
+            child = nodes.size();
+            nodes[index].children[key] = child;
+            nodes.emplace_back();
+            nodes[child].frame = frame;
+         }
+         index = child;
+         nodes[index].count++;
+         nodes[index].states[state]++;
+      }
+   }
+
+   fprintf(out, "%lld threads", (long long) nodes[0].count);
+   if (without_frames > 0) {
+      fprintf(out, " (%lld more without Java frames)", (long long) without_frames);
+   }
+   fprintf(out, "\n\n");
+
+   std::vector<int> roots;
+   for (const auto &child : nodes[0].children) {
+      roots.push_back(child.second);
+   }
+   std::sort(roots.begin(), roots.end(), [&nodes](int a, int b) {
+      return nodes[a].count > nodes[b].count;
+   });
+   for (int root : roots) {
+      printTreeNode(jvmti, jni, nodes, root, 0, out);
+   }
+}
+
+static void readRequest(int client, Request *request)
+{
+   size_t length = 0;
+   jlong deadline = monotonicNanos() + (REQUEST_TIMEOUT_MILLIS * 1000 * 1000);
+
+   // a client that has sent nothing by the time it is accepted gets the
+   // default thread dump right away, and only the rest of a request that
+   // has started is waited for
+   while (length < (sizeof(request->buffer) - 1)) {
+      jlong remaining = (length == 0) ? 0 : (deadline - monotonicNanos()) / (1000 * 1000);
+      if ((length > 0) && (remaining <= 0)) {
+         break;
+      }
+
+      pollfd pfd = {};
+      pfd.fd = client;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, remaining) <= 0) {
+         break;
+      }
+
+      ssize_t n = recv(client, request->buffer + length, sizeof(request->buffer) - 1 - length, 0);
+      if (n <= 0) {
+         break;
+      }
+      length += n;
+      if (memchr(request->buffer, '\n', length) != nullptr) {
+         break;
+      }
+   }
+   request->buffer[length] = '\0';
+
+   // split into the command and key=value arguments, where a value
+   // may be quoted to include spaces
+   request->command = "dump";
+   request->arg_count = 0;
+
+   char *p = request->buffer;
+   bool first = true;
+   while (request->arg_count < MAX_REQUEST_ARGS) {
+      while ((*p != '\0') && isspace((unsigned char) *p)) {
+         p++;
+      }
+      if (*p == '\0') {
+         break;
+      }
+
+      char *token = p;
+      char *value = nullptr;
+      char *end = nullptr;
+      while ((*p != '\0') && !isspace((unsigned char) *p)) {
+         if ((*p == '=') && (value == nullptr)) {
+            *p = '\0';
+            value = p + 1;
+            if ((*value == '"') && ((end = strchr(value + 1, '"')) != nullptr)) {
+               value++;
+               break;
+            }
+         }
+         p++;
+      }
+      if (end != nullptr) {
+         p = end;
+      }
+      if (*p != '\0') {
+         *p++ = '\0';
+      }
+
+      if (first) {
+         request->command = token;
+         first = false;
+         continue;
+      }
+      request->keys[request->arg_count] = token;
+      request->values[request->arg_count] = value ?: "";
+      request->arg_count++;
+   }
+}
+
+static void handleClient(jvmtiEnv *jvmti, JNIEnv *jni, const Request *request, FILE *out)
+{
+   if (strcmp(request->command, "dump") == 0) {
+      dumpAllThreads(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "overruns") == 0) {
+      printOverruns(jvmti, jni, out);
+   }
+   else if (strcmp(request->command, "stuck") == 0) {
+      printStuckThreads(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "pools") == 0) {
+      printPools(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "thread") == 0) {
+      printSingleThread(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "snapshot") == 0) {
+      takeSnapshot(jvmti, jni, out);
+   }
+   else if (strcmp(request->command, "snapshots") == 0) {
+      listSnapshots(jvmti, out);
+   }
+   else if (strcmp(request->command, "diff") == 0) {
+      diffSnapshots(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "tree") == 0) {
+      printCallTree(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "profile") == 0) {
+      printProfile(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "delta") == 0) {
+      printDelta(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "timeline") == 0) {
+      printTimeline(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "contention") == 0) {
+      printContention(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "waits") == 0) {
+      printWaits(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "allocations") == 0) {
+      printAllocations(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "exceptions") == 0) {
+      printExceptions(jvmti, jni, request, out);
+   }
+   else if (strcmp(request->command, "gc") == 0) {
+      printGc(jvmti, request, out);
+   }
+   else {
+      fprintf(out, "ERROR: unknown command: %s\n", request->command);
+   }
+}
+
 static int serverSocket()
 {
-   int fd = socket(AF_INET6, SOCK_STREAM, 0);
-   if (fd == -1) {
-      perror("ERROR: failed to create AStack socket");
-      exit(1);
+   int fd = socket(AF_INET6, SOCK_STREAM, 0);
+   if (fd == -1) {
+      perror("ERROR: failed to create AStack socket");
+      exit(1);
+   }
+
+   int reuse = true;
+   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
+      perror("ERROR: failed to set AStack socket option");
+      exit(1);
+   }
+
+   sockaddr_in6 addr = {};
+   addr.sin6_family = AF_INET6;
+   addr.sin6_port = htons(port);
+   addr.sin6_addr = in6addr_any;
+
+   if (bind(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+      perror("ERROR: failed to bind AStack socket");
+      exit(1);
+   }
+
+   if (listen(fd, SOMAXCONN) == -1) {
+      perror("ERROR: failed to listen on AStack socket");
+      exit(1);
+   }
+
+   return fd;
+}
+
+// listen on <socket_dir>/astack-<pid>.sock, for discovery by astackd
+static int unixServerSocket()
+{
+   if ((mkdir(socket_dir.c_str(), 0755) != 0) && (errno != EEXIST)) {
+      fprintf(stderr, "ERROR: AStack: failed to create socket directory %s: %s\n", socket_dir.c_str(), strerror(errno));
+      exit(1);
+   }
+
+   sockaddr_un addr = {};
+   addr.sun_family = AF_UNIX;
+   if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/astack-%d.sock", socket_dir.c_str(), getpid()) >= (int) sizeof(addr.sun_path)) {
+      fprintf(stderr, "ERROR: AStack: socket path in %s is too long\n", socket_dir.c_str());
+      exit(1);
+   }
+
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (fd == -1) {
+      perror("ERROR: failed to create AStack socket");
+      exit(1);
+   }
+
+   // left behind by an earlier process with the same pid
+   unlink(addr.sun_path);
+   if (bind(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+      perror("ERROR: failed to bind AStack socket");
+      exit(1);
+   }
+   socket_path = addr.sun_path;
+
+   if (listen(fd, SOMAXCONN) == -1) {
+      perror("ERROR: failed to listen on AStack socket");
+      exit(1);
+   }
+
+   return fd;
+}
+
+static void JNICALL worker(jvmtiEnv *jvmti, JNIEnv *jni, void *arg)
+{
+   pollfd servers[2] = {};
+   int server_count = 0;
+   if (port != 0) {
+      servers[server_count].fd = serverSocket();
+      servers[server_count++].events = POLLIN;
+      fprintf(stderr, "AStack listener started on port %d\n", port);
+   }
+   if (!socket_dir.empty()) {
+      servers[server_count].fd = unixServerSocket();
+      servers[server_count++].events = POLLIN;
+      fprintf(stderr, "AStack listener started on %s\n", socket_path.c_str());
+   }
+
+   while (true) {
+      if (poll(servers, server_count, -1) <= 0) {
+         continue;
+      }
+      for (int i = 0; i < server_count; i++) {
+         if ((servers[i].revents & POLLIN) == 0) {
+            continue;
+         }
+         int client = accept(servers[i].fd, nullptr, 0);
+         if (client != -1) {
+            Request request;
+            readRequest(client, &request);
+            FILE *out = fdopen(client, "w");
+            handleClient(jvmti, jni, &request, out);
+            fclose(out);
+         }
+      }
+   }
+}
+
+static jthread createThread(JNIEnv *jni, const char *threadName)
+{
+   auto clazz = jni->FindClass("java/lang/Thread");
+   if (clazz == nullptr) {
+      fprintf(stderr, "ERROR: AStack: failed to find Thread class\n");
+      exit(1);
+   }
+
+   auto init = jni->GetMethodID(clazz, "<init>", "(Ljava/lang/String;)V");
+   if (init == nullptr) {
+      fprintf(stderr, "ERROR: AStack: failed to find Thread constructor\n");
+      exit(1);
+   }
+
+   auto name = jni->NewStringUTF(threadName);
+   if (name == nullptr) {
+      fprintf(stderr, "ERROR: AStack: failed to create String object\n");
+      exit(1);
+   }
+
+   auto object = jni->NewObject(clazz, init, name);
+   if (object == nullptr) {
+      fprintf(stderr, "ERROR: AStack: failed to create Thread object\n");
+      exit(1);
+   }
+
+   return object;
+}
+
+static void createMethodIDs(jvmtiEnv *jvmti, jclass clazz)
+{
+   // allocate method IDs for AsyncGetCallTrace
+   jint count;
+   jmethodID *methods;
+   auto err = jvmti->GetClassMethods(clazz, &count, &methods);
+   if (err == JVMTI_ERROR_NONE) {
+      jvmti->Deallocate((unsigned char *) methods);
+   }
+   else if (err != JVMTI_ERROR_CLASS_NOT_PREPARED) {
+      fprintf(stderr, "WARNING: GetClassMethods failed: %d\n", err);
+   }
+}
+
+void FixedWriter::put(const void *value, size_t length)
+{
+   if (overflow || (length > (capacity - size))) {
+      overflow = true;
+      return;
+   }
+   memcpy(data + size, value, length);
+   size += length;
+}
+
+void FixedWriter::u8(uint8_t value)
+{
+   put(&value, 1);
+}
+
+void FixedWriter::u16(uint16_t value)
+{
+   uint8_t bytes[2] = {(uint8_t) value, (uint8_t) (value >> 8)};
+   put(bytes, sizeof(bytes));
+}
+
+void FixedWriter::u32(uint32_t value)
+{
+   uint8_t bytes[4];
+   putU32(bytes, value);
+   put(bytes, sizeof(bytes));
+}
+
+void FixedWriter::u64(uint64_t value)
+{
+   uint8_t bytes[8];
+   putU64(bytes, value);
+   put(bytes, sizeof(bytes));
+}
+
+void FixedWriter::str(const char *value)
+{
+   size_t len = strnlen(value, UINT16_MAX);
+   u16(len);
+   put(value, len);
+}
+
+void FixedWriter::beginRecord(uint8_t type)
+{
+   u8(type);
+   record_start = size;
+   u32(0);
+}
+
+void FixedWriter::endRecord()
+{
+   if (!overflow) {
+      putU32(data + record_start, size - record_start - 4);
+   }
+}
+
+// true if the method was not yet written by the current capture; a full
+// table only causes duplicate method records
+static bool gaspFirstMethod(jmethodID method)
+{
+   size_t slot = mixHash((uint64_t) method) % GASP_METHOD_SLOTS;
+   for (size_t i = 0; i < GASP_METHOD_SLOTS; i++) {
+      jmethodID *entry = &x_gasp_methods[(slot + i) % GASP_METHOD_SLOTS];
+      if (*entry == method) {
+         return false;
+      }
+      if (*entry == nullptr) {
+         *entry = method;
+         return true;
+      }
+   }
+   return true;
+}
+
+// Write a method record and return the line of a frame. Only cached
+// methods are symbolized, others are named by their raw jmethodID, since
+// looking them up would call into the JVM, which may be short of memory.
+static jint writeGaspMethod(jvmtiEnv *jvmti, FixedWriter *writer, const AsyncCallFrame &frame)
+{
+   jvmti->RawMonitorEnter(x_method_lock);
+   auto found = x_methods.find(frame.method);
+   const MethodInfo *info = (found != x_methods.end()) ? &found->second : nullptr;
+   jvmti->RawMonitorExit(x_method_lock);
+
+   bool first = gaspFirstMethod(frame.method);
+   if (info != nullptr) {
+      if (first) {
+         writer->beginRecord(ASTACK_RECORD_METHOD);
+         writer->u64((uint64_t) frame.method);
+         writer->str(info->class_name.c_str());
+         writer->str(info->method_name.c_str());
+         writer->str(info->source_name.c_str());
+         writer->endRecord();
+      }
+      return getLineNumber(info, frame.lineno);
+   }
+
+   if (first) {
+      char method_name[32];
+      snprintf(method_name, sizeof(method_name), "0x%llx", (unsigned long long) (uintptr_t) frame.method);
+      writer->beginRecord(ASTACK_RECORD_METHOD);
+      writer->u64((uint64_t) frame.method);
+      writer->str("Unknown");
+      writer->str(method_name);
+      writer->str("");
+      writer->endRecord();
+   }
+   return (frame.lineno < 0) ? frame.lineno : -1;
+}
+
+// must be called with x_trace_lock held
+static void writeGaspThread(jvmtiEnv *jvmti, FixedWriter *writer, ThreadTag *tag)
+{
+   jint state;
+   StackTrace trace;
+   if (!ok(jvmti->GetThreadState(tag->thread, &state)) || !captureTrace(jvmti, tag, &trace)) {
+      return;
+   }
+
+   // method records must precede the thread record referring to them
+   jint lines[MAX_FRAMES];
+   for (int i = 0; i < trace.num_frames; i++) {
+      lines[i] = writeGaspMethod(jvmti, writer, trace.frames[i]);
+   }
+
+   auto name = x_thread_names.find(tag);
+   writer->beginRecord(ASTACK_RECORD_THREAD);
+   writer->u32(tag->tid);
+   writer->u32(state);
+   writer->u8(tag->daemon);
+   writer->u32(tag->priority);
+   writer->u64(trace.context.id);
+   writer->str(trace.context.label);
+   writer->str((name != x_thread_names.end()) ? name->second.c_str() : "");
+   writer->u32(trace.num_frames);
+   for (int i = 0; i < trace.num_frames; i++) {
+      writer->u64((uint64_t) trace.frames[i].method);
+      writer->u32(lines[i]);
+   }
+   writer->endRecord();
+}
+
+// Capture all registered threads into the preallocated buffer and append
+// it as a binary stream to the gasp file, which was opened at startup.
+// A thread that does not fit is left out, along with all later threads.
+static void writeGasp(jvmtiEnv *jvmti, JNIEnv *jni, const char *reason)
+{
+   jvmti->RawMonitorEnter(x_gasp_lock);
+
+   // bounded, since an out of memory condition tends to repeat
+   jlong now = monotonicNanos();
+   if ((x_gasp_count >= MAX_GASPS) || ((x_gasp_count > 0) && ((now - x_last_gasp) < 1000 * 1000 * 1000))) {
+      jvmti->RawMonitorExit(x_gasp_lock);
+      return;
    }
+   x_gasp_count++;
+   x_last_gasp = now;
 
-   int reuse = true;
-   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
-      perror("ERROR: failed to set AStack socket option");
-      exit(1);
+   FixedWriter *writer = &x_gasp_writer;
+   writer->size = 0;
+   writer->overflow = false;
+   memset(x_gasp_methods, 0, sizeof(x_gasp_methods));
+
+   jlong time_millis = currentTimeMillis();
+   for (char c : ASTACK_MAGIC) {
+      writer->u8(c);
    }
+   writer->u16(ASTACK_VERSION);
+   writer->beginRecord(ASTACK_RECORD_GASP);
+   writer->u64(time_millis);
+   writer->str(reason);
+   writer->endRecord();
+   writer->beginRecord(ASTACK_RECORD_SNAPSHOT);
+   writer->u64(++x_last_snapshot_id);
+   writer->u64(time_millis);
+   size_t count_position = writer->size;
+   writer->u32(0);
+   writer->endRecord();
 
-   sockaddr_in6 addr = {};
-   addr.sin6_family = AF_INET6;
-   addr.sin6_port = htons(port);
-   addr.sin6_addr = in6addr_any;
+   uint32_t count = 0;
+   jvmti->RawMonitorEnter(x_trace_lock);
+   for (const auto &entry : x_threads_by_tid) {
+      size_t mark = writer->size;
+      writeGaspThread(jvmti, writer, entry.second);
+      if (writer->overflow) {
+         writer->size = mark;
+         break;
+      }
+      if (writer->size != mark) {
+         count++;
+      }
+   }
+   jvmti->RawMonitorExit(x_trace_lock);
+   putU32(writer->data + count_position, count);
 
-   if (bind(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
-      perror("ERROR: failed to bind AStack socket");
-      exit(1);
+   for (size_t written = 0; written < writer->size; ) {
+      ssize_t n = write(x_gasp_fd, writer->data + written, writer->size - written);
+      if ((n < 0) && (errno == EINTR)) {
+         continue;
+      }
+      if (n <= 0) {
+         fprintf(stderr, "WARNING: AStack: failed to write %s: %s\n", gasp_file.c_str(), strerror(errno));
+         break;
+      }
+      written += n;
    }
+   fprintf(stderr, "WARNING: AStack: wrote %u threads to %s (%s)%s\n",
+      count, gasp_file.c_str(), reason, writer->overflow ? ", truncated" : "");
 
-   if (listen(fd, SOMAXCONN) == -1) {
-      perror("ERROR: failed to listen on AStack socket");
-      exit(1);
+   jvmti->RawMonitorExit(x_gasp_lock);
+}
+
+static bool gaspOpen()
+{
+   x_gasp_fd = open(gasp_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (x_gasp_fd < 0) {
+      fprintf(stderr, "ERROR: AStack: failed to open %s: %s\n", gasp_file.c_str(), strerror(errno));
+      return false;
    }
+   x_gasp_writer.data = (uint8_t *) malloc(gasp_size);
+   x_gasp_writer.capacity = gasp_size;
+   if (x_gasp_writer.data == nullptr) {
+      fprintf(stderr, "ERROR: AStack: failed to allocate gasp buffer\n");
+      return false;
+   }
+   // touch the buffer now rather than when memory is short
+   memset(x_gasp_writer.data, 0, gasp_size);
+   return true;
+}
 
-   return fd;
+static void JNICALL onResourceExhausted(jvmtiEnv *jvmti, JNIEnv *jni, jint flags, const void *reserved, const char *description)
+{
+   writeGasp(jvmti, jni, description ?: "resource exhausted");
 }
 
-static void JNICALL worker(jvmtiEnv *jvmti, JNIEnv *jni, void *arg)
+static void JNICALL onVmDeath(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+   if (!gasp_file.empty()) {
+      writeGasp(jvmti, jni, "VM death");
+   }
+   // astackd also removes sockets of processes that are gone
+   if (!socket_path.empty()) {
+      unlink(socket_path.c_str());
+   }
+}
+
+// whether SIGTERM had no handler before the agent, so that it terminates
+// the process without a VM death event
+static bool sigtermDefault()
+{
+   return !(x_previous_sigterm.sa_flags & SA_SIGINFO) && (x_previous_sigterm.sa_handler == SIG_DFL);
+}
+
+// Wake the gasp thread and pass the signal on to the handler of the JVM,
+// which starts the shutdown. The capture runs on the gasp thread, and the
+// VM death event waits for it on x_gasp_lock. Without a previous handler,
+// the gasp thread terminates the process after the capture instead.
+static void sigtermHandler(int sig, siginfo_t *info, void *ucontext)
 {
-   int server = serverSocket();
+   int saved_errno = errno;
+   sem_post(&x_gasp_semaphore);
+   errno = saved_errno;
+
+   if (x_previous_sigterm.sa_flags & SA_SIGINFO) {
+      x_previous_sigterm.sa_sigaction(sig, info, ucontext);
+   }
+   else if ((x_previous_sigterm.sa_handler != SIG_DFL) && (x_previous_sigterm.sa_handler != SIG_IGN)) {
+      x_previous_sigterm.sa_handler(sig);
+   }
+}
 
-   fprintf(stderr, "AStack listener started on port %d\n", port);
+static void JNICALL gaspWaiter(jvmtiEnv *jvmti, JNIEnv *jni, void *arg)
+{
+   // the handler must not run on the thread it waits for
+   sigset_t mask;
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &mask, nullptr);
 
    while (true) {
-      int client = accept(server, nullptr, 0);
-      if (client != -1) {
-         FILE *out = fdopen(client, "w");
-         handleClient(jvmti, jni, out);
-         fclose(out);
+      if (sem_wait(&x_gasp_semaphore) != 0) {
+         continue;
+      }
+      writeGasp(jvmti, jni, "SIGTERM");
+      if (sigtermDefault()) {
+         // SIGTERM is blocked on this thread, so it is sent to the process
+         // and terminates it on another thread
+         signal(SIGTERM, SIG_DFL);
+         kill(getpid(), SIGTERM);
       }
    }
 }
 
-static jthread createThread(JNIEnv *jni, const char *threadName)
+static void JNICALL onMonitorContendedEnter(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object)
 {
-   auto clazz = jni->FindClass("java/lang/Thread");
-   if (clazz == nullptr) {
-      fprintf(stderr, "ERROR: AStack: failed to find Thread class\n");
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      tag->contended_since = monotonicNanos();
+   }
+}
+
+static void JNICALL onMonitorContendedEntered(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object)
+{
+   ThreadTag *tag;
+   if (!ok(jvmti->GetTag(thread, (jlong *) &tag)) || (tag == nullptr) || (tag->contended_since == 0)) {
+      return;
+   }
+   jlong nanos = monotonicNanos() - tag->contended_since;
+   tag->contended_since = 0;
+
+   // the thread has not moved on, so its stack is still where it blocked
+   jlong weight;
+   if (sampleLockEvent(&x_contention, nanos, false, contention_threshold * 1000, &weight)) {
+      recordLockEvent(jvmti, jni, &x_contention, tag, object, weight, nanos, false);
+   }
+}
+
+static void JNICALL onMonitorWait(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jlong timeout)
+{
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      tag->waiting_since = monotonicNanos();
+   }
+}
+
+static void JNICALL onMonitorWaited(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jboolean timed_out)
+{
+   ThreadTag *tag;
+   if (!ok(jvmti->GetTag(thread, (jlong *) &tag)) || (tag == nullptr) || (tag->waiting_since == 0)) {
+      return;
+   }
+   jlong nanos = monotonicNanos() - tag->waiting_since;
+   tag->waiting_since = 0;
+
+   // still inside Object.wait, at the call site of the wait
+   jlong weight;
+   if (sampleLockEvent(&x_waits, nanos, timed_out, wait_threshold * 1000, &weight)) {
+      recordLockEvent(jvmti, jni, &x_waits, tag, object, weight, nanos, timed_out);
+   }
+}
+
+// GC events may only use a few JVMTI functions, so the pauses go to a
+// ring that needs no locks
+static void JNICALL onGarbageCollectionStart(jvmtiEnv *jvmti)
+{
+   x_gc_start_micros = currentTimeMicros();
+   x_gc_start_nanos = monotonicNanos();
+}
+
+static void JNICALL onGarbageCollectionFinish(jvmtiEnv *jvmti)
+{
+   jlong start = x_gc_start_nanos.exchange(0);
+   if (start == 0) {
+      return;
+   }
+   jlong index = x_gc_count.load(std::memory_order_relaxed);
+   x_gc_writing.store(index + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   x_gc_pauses[index % GC_PAUSE_SLOTS] = {x_gc_start_micros, monotonicNanos() - start};
+   x_gc_count.store(index + 1, std::memory_order_release);
+}
+
+static void JNICALL onSampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jclass clazz, jlong size)
+{
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      recordAllocation(jvmti, jni, tag, clazz, size);
+   }
+}
+
+static void JNICALL onException(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jmethodID method, jlocation location,
+      jobject exception, jmethodID catch_method, jlocation catch_location)
+{
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      recordException(jvmti, jni, tag, method, location, exception);
+   }
+}
+
+static void signalHandler(int sig, siginfo_t *info, void *ucontext)
+{
+   AsyncGetCallTrace(&x_trace, MAX_FRAMES, ucontext);
+   x_context = x_trace_tag->context[x_trace_tag->context_index];
+   x_trace_running.clear();
+}
+
+static void JNICALL onVmInit(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+{
+   jvmtiError err;
+
+   // allocate method IDs for already loaded classes
+   jint count;
+   jclass *classes;
+   err = jvmti->GetLoadedClasses(&count, &classes);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: GetLoadedClasses failed: %d\n", err);
       exit(1);
    }
+   for (int i = 0; i < count; i++) {
+      createMethodIDs(jvmti, classes[i]);
+   }
+   jvmti->Deallocate((unsigned char *) classes);
 
-   auto init = jni->GetMethodID(clazz, "<init>", "(Ljava/lang/String;)V");
-   if (init == nullptr) {
-      fprintf(stderr, "ERROR: AStack: failed to find Thread constructor\n");
+   // install signal handler needed to invoke AsyncGetCallTrace
+   struct sigaction sa;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = SA_SIGINFO;
+   sa.sa_sigaction = signalHandler;
+   if (sigaction(SIGSTACK, &sa, nullptr) == -1) {
+      perror("ERROR: failed to install AStack signal handler");
       exit(1);
    }
 
-   auto name = jni->NewStringUTF(threadName);
-   if (name == nullptr) {
-      fprintf(stderr, "ERROR: AStack: failed to create String object\n");
+   // start agent worker threads
+   auto agent = createThread(jni, "AStack Listener");
+   err = jvmti->RunAgentThread(agent, &worker, nullptr, JVMTI_THREAD_MAX_PRIORITY);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: RunAgentThread failed: %d\n", err);
       exit(1);
    }
 
-   auto object = jni->NewObject(clazz, init, name);
-   if (object == nullptr) {
-      fprintf(stderr, "ERROR: AStack: failed to create Thread object\n");
+   auto watchdog_thread = createThread(jni, "AStack Watchdog");
+   err = jvmti->RunAgentThread(watchdog_thread, &watchdog, nullptr, JVMTI_THREAD_MAX_PRIORITY);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: RunAgentThread failed: %d\n", err);
       exit(1);
    }
 
-   return object;
+   if (!gasp_file.empty() && gasp_signal) {
+      // the JVM has installed its own handler by now, which is chained
+      sem_init(&x_gasp_semaphore, 0, 0);
+      auto gasp_thread = createThread(jni, "AStack Gasp");
+      err = jvmti->RunAgentThread(gasp_thread, &gaspWaiter, nullptr, JVMTI_THREAD_MAX_PRIORITY);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: RunAgentThread failed: %d\n", err);
+         exit(1);
+      }
+      sa.sa_sigaction = sigtermHandler;
+      if (sigaction(SIGTERM, &sa, &x_previous_sigterm) == -1) {
+         perror("ERROR: failed to install AStack SIGTERM handler");
+         exit(1);
+      }
+   }
+
+   if (sample_interval > 0) {
+      auto sampler_thread = createThread(jni, "AStack Sampler");
+      err = jvmti->RunAgentThread(sampler_thread, &sampler, nullptr, JVMTI_THREAD_MAX_PRIORITY);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: RunAgentThread failed: %d\n", err);
+         exit(1);
+      }
+   }
+}
+
+static void JNICALL onClassLoad(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jclass clazz)
+{
+   // AsyncGetCallTrace requires class load events to be enabled
+}
+
+static void JNICALL onClassPrepare(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jclass clazz)
+{
+   createMethodIDs(jvmti, clazz);
+}
+
+static jlong getJavaThreadId(JNIEnv *jni, jthread thread)
+{
+   // the method ID is the same for every thread, so racing here is harmless
+   if (x_thread_get_id == nullptr) {
+      jclass clazz = jni->FindClass("java/lang/Thread");
+      if (clazz == nullptr) {
+         jni->ExceptionClear();
+         return 0;
+      }
+      x_thread_get_id = jni->GetMethodID(clazz, "getId", "()J");
+      jni->DeleteLocalRef(clazz);
+      if (x_thread_get_id == nullptr) {
+         jni->ExceptionClear();
+         return 0;
+      }
+   }
+
+   jlong id = jni->CallLongMethod(thread, x_thread_get_id);
+   if (jni->ExceptionCheck()) {
+      jni->ExceptionClear();
+      return 0;
+   }
+   return id;
+}
+
+static void JNICALL onThreadStart(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+{
+   jvmtiError err;
+
+   ThreadTag *tag;
+   err = jvmti->Allocate(sizeof(ThreadTag), (unsigned char **) &tag);
+   if (!ok(err)) {
+      fprintf(stderr, "WARNING: Allocate failed: %d\n", err);
+      return;
+   }
+
+   memset(tag, 0, sizeof(ThreadTag));
+   tag->jni = jni;
+   tag->thread_id = pthread_self();
+   tag->tid = syscall(SYS_gettid);
+   tag->serial = ++x_last_thread_serial;
+   tag->java_id = getJavaThreadId(jni, thread);
+   tag->thread = jni->NewGlobalRef(thread);
+
+   jvmtiThreadInfo info;
+   if (!ok(jvmti->GetThreadInfo(thread, &info))) {
+      info.name = nullptr;
+   }
+
+   if (info.name != nullptr) {
+      tag->daemon = info.is_daemon;
+      tag->priority = info.priority;
+   }
+
+   jvmti->RawMonitorEnter(x_trace_lock);
+   err = jvmti->SetTag(thread, (jlong) tag);
+   if (ok(err)) {
+      registerThread(tag, info.name ?: "");
+   }
+   jvmti->RawMonitorExit(x_trace_lock);
+
+   if (info.name != nullptr) {
+      jvmti->Deallocate((unsigned char *) info.name);
+      jni->DeleteLocalRef(info.thread_group);
+      jni->DeleteLocalRef(info.context_class_loader);
+   }
+
+   if (!ok(err)) {
+      fprintf(stderr, "WARNING: SetTag for thread failed: %d\n", err);
+      jni->DeleteGlobalRef(tag->thread);
+      jvmti->Deallocate((unsigned char *) tag);
+   }
+}
+
+static void JNICALL onThreadEnd(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+{
+   jvmti->RawMonitorEnter(x_watchdog_lock);
+   jvmti->RawMonitorEnter(x_trace_lock);
+
+   ThreadTag *tag;
+   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
+      wheelRemove(tag);
+      finishOverrun(tag);
+      unregisterThread(tag);
+      jni->DeleteGlobalRef(tag->thread);
+      jvmti->Deallocate((unsigned char *) tag);
+      auto err = jvmti->SetTag(thread, 0);
+      if (!ok(err)) {
+         fprintf(stderr, "WARNING: SetTag for thread failed: %d\n", err);
+      }
+   }
+
+   jvmti->RawMonitorExit(x_trace_lock);
+   jvmti->RawMonitorExit(x_watchdog_lock);
+}
+
+static ThreadTag *currentThreadTag(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+   jthread thread;
+   if (!ok(jvmti->GetCurrentThread(&thread))) {
+      return nullptr;
+   }
+
+   ThreadTag *tag;
+   if (!ok(jvmti->GetTag(thread, (jlong *) &tag))) {
+      tag = nullptr;
+   }
+   jni->DeleteLocalRef(thread);
+   return tag;
+}
+
+static void copyContextLabel(JNIEnv *jni, jstring label, char *buffer)
+{
+   buffer[0] = '\0';
+   if (label == nullptr) {
+      return;
+   }
+
+   const char *chars = jni->GetStringUTFChars(label, nullptr);
+   if (chars == nullptr) {
+      return;
+   }
+
+   size_t len = strlen(chars);
+   if (len >= MAX_CONTEXT_LABEL) {
+      // truncate without splitting a multi-byte character
+      len = MAX_CONTEXT_LABEL - 1;
+      while ((len > 0) && ((chars[len] & 0xC0) == 0x80)) {
+         len--;
+      }
+   }
+
+   // labels are emitted verbatim, so keep them on a single token
+   for (size_t i = 0; i < len; i++) {
+      unsigned char c = chars[i];
+      buffer[i] = ((c <= ' ') || (c == ';')) ? '_' : c;
+   }
+   buffer[len] = '\0';
+
+   jni->ReleaseStringUTFChars(label, chars);
+}
+
+extern "C" JNIEXPORT jboolean JNICALL
+Java_io_airlift_astack_AStack_agentLoaded0(JNIEnv *jni, jclass clazz)
+{
+   return JNI_TRUE;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_airlift_astack_AStack_setContext0(JNIEnv *jni, jclass clazz, jlong id, jstring label)
+{
+   ThreadTag *tag = currentThreadTag(agent_jvmti, jni);
+   if (tag == nullptr) {
+      return;
+   }
+
+   int next = 1 - tag->context_index;
+   tag->context[next].id = id;
+   copyContextLabel(jni, label, tag->context[next].label);
+
+   // publish only after the slot is fully written
+   std::atomic_signal_fence(std::memory_order_release);
+   tag->context_index = next;
 }
 
-static void createMethodIDs(jvmtiEnv *jvmti, jclass clazz)
+extern "C" JNIEXPORT void JNICALL
+Java_io_airlift_astack_AStack_armDeadline0(JNIEnv *jni, jclass clazz, jlong timeout_millis)
 {
-   // allocate method IDs for AsyncGetCallTrace
-   jint count;
-   jmethodID *methods;
-   auto err = jvmti->GetClassMethods(clazz, &count, &methods);
-   if (err == JVMTI_ERROR_NONE) {
-      jvmti->Deallocate((unsigned char *) methods);
-   }
-   else if (err != JVMTI_ERROR_CLASS_NOT_PREPARED) {
-      fprintf(stderr, "WARNING: GetClassMethods failed: %d\n", err);
+   ThreadTag *tag = currentThreadTag(agent_jvmti, jni);
+   if (tag == nullptr) {
+      return;
    }
+
+   agent_jvmti->RawMonitorEnter(x_watchdog_lock);
+
+   wheelRemove(tag);
+   finishOverrun(tag);
+   tag->deadline = monotonicNanos() + (timeout_millis * 1000 * 1000);
+   tag->timeout_millis = timeout_millis;
+   tag->armed_millis = currentTimeMillis();
+   wheelInsert(tag);
+
+   agent_jvmti->RawMonitorNotify(x_watchdog_lock);
+   agent_jvmti->RawMonitorExit(x_watchdog_lock);
 }
 
-static void signalHandler(int sig, siginfo_t *info, void *ucontext)
+extern "C" JNIEXPORT void JNICALL
+Java_io_airlift_astack_AStack_disarmDeadline0(JNIEnv *jni, jclass clazz)
 {
-   AsyncGetCallTrace(&x_trace, MAX_FRAMES, ucontext);
-   x_trace_running.clear();
+   ThreadTag *tag = currentThreadTag(agent_jvmti, jni);
+   if (tag == nullptr) {
+      return;
+   }
+
+   agent_jvmti->RawMonitorEnter(x_watchdog_lock);
+   wheelRemove(tag);
+   finishOverrun(tag);
+   agent_jvmti->RawMonitorExit(x_watchdog_lock);
 }
 
-static void JNICALL onVmInit(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+static void throwException(JNIEnv *jni, const char *class_name, const char *message)
 {
-   jvmtiError err;
+   jclass clazz = jni->FindClass(class_name);
+   if (clazz != nullptr) {
+      jni->ThrowNew(clazz, message);
+      jni->DeleteLocalRef(clazz);
+   }
+}
 
-   // allocate method IDs for already loaded classes
-   jint count;
-   jclass *classes;
-   err = jvmti->GetLoadedClasses(&count, &classes);
-   if (!ok(err)) {
-      fprintf(stderr, "ERROR: GetLoadedClasses failed: %d\n", err);
-      exit(1);
+// the ordinal of an AStack.Format, which is passed as a plain int
+static bool checkFormat(JNIEnv *jni, jint format)
+{
+   if ((format < FORMAT_TEXT) || (format > FORMAT_BINARY)) {
+      std::string message = "AStack unknown snapshot format: " + std::to_string(format);
+      throwException(jni, "java/lang/IllegalArgumentException", message.c_str());
+      return false;
    }
-   for (int i = 0; i < count; i++) {
-      createMethodIDs(jvmti, classes[i]);
+   return true;
+}
+
+extern "C" JNIEXPORT jbyteArray JNICALL
+Java_io_airlift_astack_AStack_snapshot0(JNIEnv *jni, jclass clazz, jint format)
+{
+   if (!checkFormat(jni, format)) {
+      return nullptr;
    }
-   jvmti->Deallocate((unsigned char *) classes);
 
-   // install signal handler needed to invoke AsyncGetCallTrace
-   struct sigaction sa;
-   sigemptyset(&sa.sa_mask);
-   sa.sa_flags = SA_SIGINFO;
-   sa.sa_sigaction = signalHandler;
-   if (sigaction(SIGSTACK, &sa, nullptr) == -1) {
-      perror("ERROR: failed to install AStack signal handler");
-      exit(1);
+   auto snapshot = captureRetainedSnapshot(agent_jvmti, jni);
+   if (snapshot == nullptr) {
+      throwException(jni, "java/lang/IllegalStateException", "AStack failed to list threads");
+      return nullptr;
    }
 
-   // start agent worker thread
-   auto agent = createThread(jni, "AStack Listener");
-   err = jvmti->RunAgentThread(agent, &worker, nullptr, JVMTI_THREAD_MAX_PRIORITY);
-   if (!ok(err)) {
-      fprintf(stderr, "ERROR: RunAgentThread failed: %d\n", err);
-      exit(1);
+   char *data;
+   size_t size;
+   FILE *out = open_memstream(&data, &size);
+   if (out == nullptr) {
+      throwException(jni, "java/lang/OutOfMemoryError", "AStack failed to allocate snapshot buffer");
+      return nullptr;
    }
-}
+   writeSnapshot(agent_jvmti, jni, snapshot.get(), (SnapshotFormat) format, out);
+   fclose(out);
 
-static void JNICALL onClassLoad(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jclass clazz)
-{
-   // AsyncGetCallTrace requires class load events to be enabled
+   jbyteArray result = jni->NewByteArray(size);
+   if (result != nullptr) {
+      jni->SetByteArrayRegion(result, 0, size, (const jbyte *) data);
+   }
+   free(data);
+   return result;
 }
 
-static void JNICALL onClassPrepare(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jclass clazz)
+extern "C" JNIEXPORT void JNICALL
+Java_io_airlift_astack_AStack_writeSnapshot0(JNIEnv *jni, jclass clazz, jint format, jstring path)
 {
-   createMethodIDs(jvmti, clazz);
-}
+   if (!checkFormat(jni, format)) {
+      return;
+   }
 
-static void JNICALL onThreadStart(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
-{
-   jvmtiError err;
+   const char *file_name = jni->GetStringUTFChars(path, nullptr);
+   if (file_name == nullptr) {
+      return;
+   }
 
-   ThreadTag *tag;
-   err = jvmti->Allocate(sizeof(ThreadTag), (unsigned char **) &tag);
-   if (!ok(err)) {
-      fprintf(stderr, "WARNING: Allocate failed: %d\n", err);
+   auto snapshot = captureRetainedSnapshot(agent_jvmti, jni);
+   if (snapshot == nullptr) {
+      jni->ReleaseStringUTFChars(path, file_name);
+      throwException(jni, "java/lang/IllegalStateException", "AStack failed to list threads");
       return;
    }
 
-   tag->jni = jni;
-   tag->thread_id = pthread_self();
+   FILE *out = fopen(file_name, "w");
+   if (out == nullptr) {
+      std::string message = std::string(file_name) + ": " + strerror(errno);
+      jni->ReleaseStringUTFChars(path, file_name);
+      throwException(jni, "java/io/IOException", message.c_str());
+      return;
+   }
 
-   err = jvmti->SetTag(thread, (jlong) tag);
-   if (!ok(err)) {
-      fprintf(stderr, "WARNING: SetTag for thread failed: %d\n", err);
-      jvmti->Deallocate((unsigned char *) tag);
+   writeSnapshot(agent_jvmti, jni, snapshot.get(), (SnapshotFormat) format, out);
+   bool failed = ferror(out);
+   if ((fclose(out) != 0) || failed) {
+      std::string message = std::string(file_name) + ": " + strerror(errno);
+      jni->ReleaseStringUTFChars(path, file_name);
+      throwException(jni, "java/io/IOException", message.c_str());
+      return;
    }
+
+   jni->ReleaseStringUTFChars(path, file_name);
 }
 
-static void JNICALL onThreadEnd(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+static bool parseOptions(char *options)
 {
-   jvmti->RawMonitorEnter(x_trace_lock);
+   if (options == nullptr) {
+      fprintf(stderr, "ERROR: failed to parse port option\n");
+      return false;
+   }
 
-   ThreadTag *tag;
-   if (ok(jvmti->GetTag(thread, (jlong *) &tag)) && (tag != nullptr)) {
-      jvmti->Deallocate((unsigned char *) tag);
-      auto err = jvmti->SetTag(thread, 0);
-      if (!ok(err)) {
-         fprintf(stderr, "WARNING: SetTag for thread failed: %d\n", err);
+   jlong value;
+   char *save;
+   for (char *option = strtok_r(options, ",", &save); option != nullptr; option = strtok_r(nullptr, ",", &save)) {
+      char *equals = strchr(option, '=');
+      if (equals == nullptr) {
+         fprintf(stderr, "ERROR: invalid AStack option: %s\n", option);
+         return false;
+      }
+      *equals = '\0';
+      const char *name = option;
+      const char *text = equals + 1;
+
+      if (strcmp(name, "port") == 0) {
+         if (!parseLong(text, &value) || (value <= 0) || (value > 65535)) {
+            fprintf(stderr, "ERROR: failed to parse port option\n");
+            return false;
+         }
+         port = value;
+      }
+      else if (strcmp(name, "deadline_interval") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         deadline_interval = value;
+      }
+      else if (strcmp(name, "interval") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         sample_interval = value;
+      }
+      else if (strcmp(name, "stuck_threshold") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         stuck_threshold = value;
+      }
+      else if (strcmp(name, "snapshots") == 0) {
+         if (!parseLong(text, &value) || (value < 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         max_snapshots = value;
+      }
+      else if ((strcmp(name, "max_threads") == 0) || (strcmp(name, "max_bytes") == 0)) {
+         if (!parseLong(text, &value) || (value < 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         *((strcmp(name, "max_threads") == 0) ? &max_threads : &max_bytes) = value;
+      }
+      else if (strcmp(name, "contention") == 0) {
+         if (!parseBool(text, &contention)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else if (strcmp(name, "contention_threshold") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         contention_threshold = value;
+      }
+      else if (strcmp(name, "waits") == 0) {
+         if (!parseBool(text, &waits)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else if (strcmp(name, "wait_threshold") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         wait_threshold = value;
+      }
+      else if (strcmp(name, "alloc_interval") == 0) {
+         if (!parseLong(text, &value) || (value <= 0) || (value > INT32_MAX)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         alloc_interval = value;
+      }
+      else if (strcmp(name, "exceptions") == 0) {
+         if (!parseBool(text, &exceptions)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else if (strcmp(name, "exception_samples") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         exception_samples = value;
+      }
+      else if (strcmp(name, "gc") == 0) {
+         if (!parseBool(text, &gc)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else if (strcmp(name, "timeline") == 0) {
+         if (!parseLong(text, &value) || (value < 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         timeline_samples = value;
+      }
+      else if ((strcmp(name, "bucket") == 0) || (strcmp(name, "history") == 0) || (strcmp(name, "max_stacks") == 0)) {
+         if (!parseLong(text, &value) || (value <= 0) || (value > UINT32_MAX)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         if (strcmp(name, "bucket") == 0) {
+            bucket_seconds = value;
+         }
+         else if (strcmp(name, "history") == 0) {
+            history_seconds = value;
+         }
+         else {
+            max_stacks = value;
+         }
+      }
+      else if (strcmp(name, "socket_dir") == 0) {
+         if (*text == '\0') {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         socket_dir = text;
+      }
+      else if (strcmp(name, "spool_dir") == 0) {
+         if (*text == '\0') {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         spool_dir = text;
+      }
+      else if (strcmp(name, "spool_size") == 0) {
+         // room for the segment record with its index, and some records
+         jlong minimum = ASTACK_SEGMENT_INDEX + (SPOOL_INDEX_CAPACITY * ASTACK_SEGMENT_INDEX_ENTRY_SIZE) + (64 * 1024);
+         if (!parseLong(text, &value) || (value < minimum) || (value > UINT32_MAX)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         spool_size = value;
+      }
+      else if (strcmp(name, "spool_segments") == 0) {
+         if (!parseLong(text, &value) || (value <= 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         spool_segments = value;
+      }
+      else if (strcmp(name, "ring_file") == 0) {
+         if (*text == '\0') {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         ring_file = text;
+      }
+      else if (strcmp(name, "ring_size") == 0) {
+         if (!parseLong(text, &value) || (value < 64 * 1024) || (value > UINT32_MAX) || ((value % 8) != 0)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         ring_size = value;
+      }
+      else if (strcmp(name, "gasp_file") == 0) {
+         if (*text == '\0') {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         gasp_file = text;
+      }
+      else if (strcmp(name, "gasp_size") == 0) {
+         if (!parseLong(text, &value) || (value < 64 * 1024)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         gasp_size = value;
+      }
+      else if (strcmp(name, "gasp_signal") == 0) {
+         if (!parseBool(text, &gasp_signal)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else if (strcmp(name, "pool_pattern") == 0) {
+         pool_patterns.emplace_back();
+         if (!compilePattern(text, &pool_patterns.back())) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else if ((strcmp(name, "fold") == 0) || (strcmp(name, "drop") == 0)) {
+         // fold=<class prefix>[=<label>] or drop=<class prefix>
+         FoldRule rule;
+         const char *label = strchr(text, '=');
+         rule.prefix = label ? std::string(text, label - text) : text;
+         rule.label = label ? std::string(label + 1) : (rule.prefix + "*");
+         rule.drop = strcmp(name, "drop") == 0;
+         if (rule.prefix.empty() || rule.label.empty()) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+         fold_rules.push_back(rule);
+      }
+      else if (strcmp(name, "stuck_log") == 0) {
+         if (!parseBool(text, &stuck_log)) {
+            fprintf(stderr, "ERROR: invalid value for %s option: %s\n", name, text);
+            return false;
+         }
+      }
+      else {
+         fprintf(stderr, "ERROR: unknown AStack option: %s\n", name);
+         return false;
       }
    }
 
-   jvmti->RawMonitorExit(x_trace_lock);
+   if ((port == 0) && socket_dir.empty()) {
+      fprintf(stderr, "ERROR: failed to parse port option\n");
+      return false;
+   }
+
+   // one spare bucket, so the full history is retained while the newest
+   // bucket is being filled
+   x_buckets.resize(((history_seconds + bucket_seconds - 1) / bucket_seconds) + 1);
+
+   if (pool_patterns.empty()) {
+      // strip numeric suffixes such as "-12" or " #3"
+      pool_patterns.emplace_back();
+      compilePattern(DEFAULT_POOL_PATTERN, &pool_patterns.back());
+   }
+   return true;
 }
 
 JNIEXPORT jint JNICALL
@@ -467,8 +5914,7 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved)
    jvmtiError err;
 
    // parse options
-   if ((options == nullptr) || (sscanf(options, "port=%d", &port) != 1)) {
-      fprintf(stderr, "ERROR: failed to parse port option\n");
+   if (!parseOptions(options)) {
       return JNI_ERR;
    }
 
@@ -478,19 +5924,97 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved)
       fprintf(stderr, "ERROR: GetEnv failed: %d\n", rc);
       return JNI_ERR;
    }
+   agent_jvmti = jvmti;
 
-   // create lock
+   // create locks
    err = jvmti->CreateRawMonitor("astack_trace", &x_trace_lock);
    if (!ok(err)) {
       fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
       return JNI_ERR;
    }
 
+   err = jvmti->CreateRawMonitor("astack_watchdog", &x_watchdog_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_methods", &x_method_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_snapshots", &x_snapshot_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_profile", &x_profile_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_locks", &x_lock_profile_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_exceptions", &x_exception_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_spool", &x_spool_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   if (!spool_dir.empty() && !spoolOpen()) {
+      return JNI_ERR;
+   }
+
+   err = jvmti->CreateRawMonitor("astack_gasp", &x_gasp_lock);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: CreateRawMonitor failed: %d\n", err);
+      return JNI_ERR;
+   }
+
+   if (!gasp_file.empty() && !gaspOpen()) {
+      return JNI_ERR;
+   }
+
+   if (!ring_file.empty() && !ringOpen()) {
+      return JNI_ERR;
+   }
+
    // add capabilities
+   jvmtiCapabilities potential = {};
+   err = jvmti->GetPotentialCapabilities(&potential);
+   if (!ok(err)) {
+      fprintf(stderr, "ERROR: GetPotentialCapabilities failed: %d\n", err);
+      return JNI_ERR;
+   }
+
    jvmtiCapabilities capabilities = {};
    capabilities.can_get_source_file_name = true;
    capabilities.can_get_line_numbers = true;
    capabilities.can_tag_objects = true;
+   capabilities.can_get_thread_cpu_time = potential.can_get_thread_cpu_time;
+   if (!gasp_file.empty()) {
+      capabilities.can_generate_resource_exhaustion_heap_events = potential.can_generate_resource_exhaustion_heap_events;
+      capabilities.can_generate_resource_exhaustion_threads_events = potential.can_generate_resource_exhaustion_threads_events;
+   }
+   capabilities.can_generate_monitor_events = contention || waits;
+   capabilities.can_generate_sampled_object_alloc_events = (alloc_interval > 0);
+   capabilities.can_generate_exception_events = exceptions;
+   capabilities.can_generate_garbage_collection_events = gc;
+   cpu_time_enabled = potential.can_get_thread_cpu_time;
 
    err = jvmti->AddCapabilities(&capabilities);
    if (!ok(err)) {
@@ -505,6 +6029,16 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved)
    callbacks.ClassPrepare = &onClassPrepare;
    callbacks.ThreadStart = &onThreadStart;
    callbacks.ThreadEnd = &onThreadEnd;
+   callbacks.ResourceExhausted = &onResourceExhausted;
+   callbacks.VMDeath = &onVmDeath;
+   callbacks.MonitorContendedEnter = &onMonitorContendedEnter;
+   callbacks.MonitorContendedEntered = &onMonitorContendedEntered;
+   callbacks.MonitorWait = &onMonitorWait;
+   callbacks.MonitorWaited = &onMonitorWaited;
+   callbacks.SampledObjectAlloc = &onSampledObjectAlloc;
+   callbacks.Exception = &onException;
+   callbacks.GarbageCollectionStart = &onGarbageCollectionStart;
+   callbacks.GarbageCollectionFinish = &onGarbageCollectionFinish;
 
    err = jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
    if (!ok(err)) {
@@ -529,5 +6063,75 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved)
       }
    }
 
+   if (!gasp_file.empty()) {
+      err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_RESOURCE_EXHAUSTED, nullptr);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+         return JNI_ERR;
+      }
+   }
+
+   if (contention) {
+      for (auto event : {JVMTI_EVENT_MONITOR_CONTENDED_ENTER, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED}) {
+         err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, nullptr);
+         if (!ok(err)) {
+            fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+            return JNI_ERR;
+         }
+      }
+   }
+
+   if (gc) {
+      for (auto event : {JVMTI_EVENT_GARBAGE_COLLECTION_START, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH}) {
+         err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, nullptr);
+         if (!ok(err)) {
+            fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+            return JNI_ERR;
+         }
+      }
+   }
+
+   if (exceptions) {
+      x_exception_tokens = exception_samples;
+      x_exception_refill_nanos = monotonicNanos();
+      err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, nullptr);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+         return JNI_ERR;
+      }
+      x_exceptions_enabled = true;
+   }
+
+   if (alloc_interval > 0) {
+      err = jvmti->SetHeapSamplingInterval(alloc_interval);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: SetHeapSamplingInterval failed: %d\n", err);
+         return JNI_ERR;
+      }
+      err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+         return JNI_ERR;
+      }
+   }
+
+   if (waits) {
+      for (auto event : {JVMTI_EVENT_MONITOR_WAIT, JVMTI_EVENT_MONITOR_WAITED}) {
+         err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, nullptr);
+         if (!ok(err)) {
+            fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+            return JNI_ERR;
+         }
+      }
+   }
+
+   if (!gasp_file.empty() || !socket_dir.empty()) {
+      err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, nullptr);
+      if (!ok(err)) {
+         fprintf(stderr, "ERROR: SetEventNotificationMode failed: %d\n", err);
+         return JNI_ERR;
+      }
+   }
+
    return JNI_OK;
 }
@@ -0,0 +1,159 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASTACK_FORMAT_H
+#define ASTACK_FORMAT_H
+
+#include <stdint.h>
+
+// Binary snapshot stream written by the agent.
+//
+// A stream starts with the four magic bytes and a u16 version, followed
+// by records. Every record starts with a u8 type and a u32 payload
+// length, so readers can skip record types they do not understand.
+// Integers are little-endian, and strings are a u16 byte length followed
+// by UTF-8 bytes without a terminator.
+//
+// Method IDs are only meaningful within a single stream. A method record
+// always precedes the first frame that refers to it.
+
+static const char ASTACK_MAGIC[4] = {'A', 'S', 'T', 'K'};
+static const uint16_t ASTACK_VERSION = 1;
+static const uint32_t ASTACK_RECORD_HEADER_SIZE = 5;
+
+enum AStackRecordType {
+   // i64 snapshot id, i64 time (epoch millis), u32 number of thread
+   // records that follow
+   ASTACK_RECORD_SNAPSHOT = 1,
+
+   // u64 method id, str class, str method, str source file (empty if unknown)
+   ASTACK_RECORD_METHOD = 2,
+
+   // u32 tid, i32 JVMTI thread state, u8 daemon, i32 priority,
+   // i64 context id, str context label, str name, u32 frame count,
+   // then per frame: u64 method id, i32 line (-3 for native methods,
+   // zero or negative when unknown)
+   ASTACK_RECORD_THREAD = 3,
+
+   // i64 snapshot id, u32 index of the next thread; ends a page of a
+   // snapshot that has more threads
+   ASTACK_RECORD_CURSOR = 4,
+
+   // i64 start time, i64 end time (epoch millis), u32 sequence,
+   // u32 data end, u32 dictionary start, u32 index count,
+   // u32 index capacity, then per index entry: i64 time, u32 offset;
+   // the fixed first record of a spool segment, updated in place
+   ASTACK_RECORD_SEGMENT = 5,
+
+   // u32 stack id, u32 frame count, then per frame: u64 method id, i32 line
+   ASTACK_RECORD_STACK = 6,
+
+   // i64 time (epoch millis), u32 tid, i32 JVMTI thread state,
+   // i64 context id, u32 stack id
+   ASTACK_RECORD_SAMPLE = 7,
+
+   // u32 tid, str name; names the thread of later samples with the tid
+   ASTACK_RECORD_THREAD_NAME = 8,
+
+   // i64 time (epoch millis), str reason; precedes the snapshot written
+   // when the JVM runs out of a resource or shuts down
+   ASTACK_RECORD_GASP = 9,
+
+   // i64 time (epoch millis), u32 tid, i32 JVMTI thread state,
+   // i64 context id, u32 frame count, then per frame: u64 method id,
+   // i32 bytecode index (-3 for native methods, other negative values
+   // when unknown); lines are resolved through the line table records
+   ASTACK_RECORD_RAW_SAMPLE = 10,
+
+   // u64 method id, u32 entry count, then per entry: i64 start bytecode
+   // index, i32 line; follows the method record
+   ASTACK_RECORD_LINE_TABLE = 11,
+
+   // empty; marks where a consumer of a ring can start, since the records
+   // that follow it repeat every method, line table, thread name and
+   // context label a later sample uses
+   ASTACK_RECORD_DICTIONARY = 12,
+
+   // i64 context id, str label; labels the context of later samples with
+   // the context id
+   ASTACK_RECORD_CONTEXT_LABEL = 13,
+};
+
+// Ring file written by the agent, for consumers in other processes.
+//
+// The file has a header of ASTACK_RING_HEADER_SIZE bytes followed by the
+// data area. The header starts with the magic bytes and the version, and
+// a zero byte where a stream has its first record type. Positions in the
+// ring are sequences, which count the bytes written since the start, and
+// are at the data offset sequence % capacity.
+//
+// Records have the usual type and length, and each occupies the record
+// size rounded up to a multiple of 8 bytes. A record never wraps around;
+// a padding record (type 0) fills the rest of the data area instead.
+//
+// The head is the end of the published records, the tail is the oldest
+// record not yet overwritten, and the dictionary is the start of the
+// latest dictionary record, possibly preceded by padding. It is always
+// between the two. The agent moves the tail before overwriting, and moves
+// the head after writing, both as release stores. After each dictionary, a
+// method and its line table are published before the first sample that
+// uses them, a thread name record before the first sample of a thread with
+// that name, and a context label record before the first sample with that
+// label.
+//
+// A consumer starts at the dictionary sequence, and reads records up to
+// the head (an acquire load). After copying a record, it checks that the
+// tail (again an acquire load) has not moved past the record. Otherwise
+// the copy may be torn, and the consumer lost records and starts over at
+// the dictionary sequence.
+
+static const uint32_t ASTACK_RING_DATA_CAPACITY = 12;
+static const uint32_t ASTACK_RING_HEAD = 16;
+static const uint32_t ASTACK_RING_TAIL = 24;
+static const uint32_t ASTACK_RING_DICTIONARY = 32;
+static const uint32_t ASTACK_RING_PID = 40;
+static const uint32_t ASTACK_RING_START_TIME = 48;
+static const uint32_t ASTACK_RING_HEADER_SIZE = 64;
+
+// Spool segment written by the agent.
+//
+// A segment is a file of a fixed size that starts like a stream, followed
+// by the segment record. Sample and snapshot records are appended to the
+// data area, from the end of the segment record up to the data end. The
+// dictionary of method and stack records used by the segment is written
+// backwards from the end of the file, and is read as a record stream from
+// the dictionary start to the end of the file. Both offsets are updated
+// after each record is complete, so a segment left by a crashed process
+// is consistent up to the last complete record. Thread name and context
+// label records are data records, since they only apply to the samples
+// after them.
+//
+// Each index entry has the offset of the first data record of a second,
+// in ascending time order. A reader looking for a time range only scans
+// the data area from the last entry before the start of the range. Once
+// the index is full, later records are not indexed. Thread names and
+// context labels are written again after each entry, before the first
+// sample that uses them, so a reader needs no records before the entry.
+
+static const uint32_t ASTACK_SEGMENT_START_TIME = 11;
+static const uint32_t ASTACK_SEGMENT_END_TIME = 19;
+static const uint32_t ASTACK_SEGMENT_SEQUENCE = 27;
+static const uint32_t ASTACK_SEGMENT_DATA_END = 31;
+static const uint32_t ASTACK_SEGMENT_DICTIONARY_START = 35;
+static const uint32_t ASTACK_SEGMENT_INDEX_COUNT = 39;
+static const uint32_t ASTACK_SEGMENT_INDEX_CAPACITY = 43;
+static const uint32_t ASTACK_SEGMENT_INDEX = 47;
+static const uint32_t ASTACK_SEGMENT_INDEX_ENTRY_SIZE = 12;
+
+#endif
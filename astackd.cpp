@@ -0,0 +1,674 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host daemon for the agents of all JVMs on a host. Agents started with
+// socket_dir listen on a Unix socket in that directory. The daemon sends
+// each request it receives to all of them at once from a single epoll
+// loop, and merges their responses with a process label on every stack.
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *const DEFAULT_SOCKET_DIR = "/tmp/astack";
+static const int64_t REQUEST_TIMEOUT_MILLIS = 100;
+static const size_t MAX_REQUEST_SIZE = 4096;
+static const int MAX_EVENTS = 64;
+
+// options of the JVM launcher that take the next argument as their value
+static const char *const LAUNCHER_VALUE_OPTIONS[] = {
+   "-cp", "-classpath", "--class-path", "-p", "--module-path", "--upgrade-module-path",
+   "--add-modules", "--limit-modules", "--add-reads", "--add-exports", "--add-opens", "--patch-module",
+};
+
+enum ConnectionKind {
+   CONNECTION_LISTENER,
+   CONNECTION_CLIENT,
+   CONNECTION_AGENT,
+};
+
+enum ClientState {
+   CLIENT_READING,
+   CLIENT_WAITING, // for the responses of the agents
+   CLIENT_WRITING,
+   CLIENT_CLOSED,
+};
+
+struct Client;
+struct Agent;
+
+// registered with epoll, so that an event finds its owner
+struct Connection {
+   ConnectionKind kind;
+   int fd = -1;
+   Client *client = nullptr;
+   Agent *agent = nullptr;
+};
+
+struct Agent {
+   Connection connection;
+   pid_t pid;
+   std::string label;
+   size_t sent = 0;
+   std::string response;
+   std::string error; // empty if the response is complete
+};
+
+struct Client {
+   Connection connection;
+   ClientState state = CLIENT_READING;
+   int64_t deadline; // monotonic milliseconds
+   std::string request;
+   std::vector<std::unique_ptr<Agent>> agents;
+   size_t pending = 0;
+   std::string output;
+   size_t written = 0;
+};
+
+struct Options {
+   std::string socket_dir = DEFAULT_SOCKET_DIR;
+   int64_t port = 0;
+   int64_t timeout_millis = 10 * 1000;
+};
+
+static Options options;
+static int epoll_fd;
+static std::vector<std::unique_ptr<Client>> clients;
+
+static int64_t monotonicMillis()
+{
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000) + (ts.tv_nsec / (1000 * 1000));
+}
+
+static bool parseLong(const char *value, int64_t *result)
+{
+   char *end;
+   errno = 0;
+   long long parsed = strtoll(value, &end, 10);
+   if ((errno != 0) || (end == value) || (*end != '\0')) {
+      return false;
+   }
+   *result = parsed;
+   return true;
+}
+
+static bool processAlive(pid_t pid)
+{
+   return (kill(pid, 0) == 0) || (errno == EPERM);
+}
+
+// main class, module or jar of a JVM from its command line
+static std::string mainName(const std::vector<std::string> &args)
+{
+   for (size_t i = 1; i < args.size(); i++) {
+      const std::string &arg = args[i];
+      bool has_next = (i + 1) < args.size();
+      if ((arg == "-jar") && has_next) {
+         const std::string &jar = args[i + 1];
+         size_t slash = jar.rfind('/');
+         return (slash == std::string::npos) ? jar : jar.substr(slash + 1);
+      }
+      if (((arg == "-m") || (arg == "--module")) && has_next) {
+         const std::string &module = args[i + 1];
+         size_t slash = module.find('/');
+         return (slash == std::string::npos) ? module : module.substr(slash + 1);
+      }
+      bool takes_value = false;
+      for (const char *option : LAUNCHER_VALUE_OPTIONS) {
+         takes_value |= (arg == option);
+      }
+      if (takes_value) {
+         i++;
+      }
+      else if (!arg.empty() && (arg[0] != '-') && (arg[0] != '@')) {
+         return arg;
+      }
+   }
+   return "java";
+}
+
+static std::string processLabel(pid_t pid)
+{
+   std::vector<std::string> args;
+   char path[64];
+   snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+   FILE *file = fopen(path, "r");
+   if (file != nullptr) {
+      std::string arg;
+      int c;
+      while ((c = fgetc(file)) != EOF) {
+         if (c == '\0') {
+            args.push_back(arg);
+            arg.clear();
+         }
+         else {
+            arg += (char) c;
+         }
+      }
+      fclose(file);
+   }
+
+   // the label becomes the root frame of folded stacks
+   std::string label = mainName(args);
+   std::replace(label.begin(), label.end(), ';', '_');
+   std::replace(label.begin(), label.end(), ' ', '_');
+   return label + "[" + std::to_string(pid) + "]";
+}
+
+// pids of the agent sockets, removing those of processes that are gone
+static std::vector<pid_t> discoverAgents()
+{
+   std::vector<pid_t> pids;
+   DIR *dir = opendir(options.socket_dir.c_str());
+   if (dir == nullptr) {
+      return pids;
+   }
+   while (dirent *entry = readdir(dir)) {
+      int pid;
+      int end = 0;
+      if ((sscanf(entry->d_name, "astack-%d.sock%n", &pid, &end) != 1) || (entry->d_name[end] != '\0') || (pid <= 0)) {
+         continue;
+      }
+      if (!processAlive(pid)) {
+         unlink((options.socket_dir + "/" + entry->d_name).c_str());
+         continue;
+      }
+      pids.push_back(pid);
+   }
+   closedir(dir);
+   std::sort(pids.begin(), pids.end());
+   return pids;
+}
+
+static void watch(Connection *connection, int op, uint32_t events)
+{
+   epoll_event event = {};
+   event.events = events;
+   event.data.ptr = connection;
+   if (epoll_ctl(epoll_fd, op, connection->fd, &event) == -1) {
+      perror("ERROR: epoll_ctl failed");
+      exit(1);
+   }
+}
+
+// closing the descriptor also removes it from epoll
+static void closeConnection(Connection *connection)
+{
+   if (connection->fd != -1) {
+      close(connection->fd);
+      connection->fd = -1;
+   }
+}
+
+// the command and format of a request, as parsed by the agent
+static void parseRequest(const std::string &request, std::string *command, std::string *format)
+{
+   size_t p = 0;
+   bool first = true;
+   *command = "dump";
+   while (p < request.size()) {
+      while ((p < request.size()) && isspace((unsigned char) request[p])) {
+         p++;
+      }
+      size_t start = p;
+      while ((p < request.size()) && !isspace((unsigned char) request[p])) {
+         p++;
+      }
+      if (start == p) {
+         break;
+      }
+      std::string token = request.substr(start, p - start);
+      if (first) {
+         *command = token.substr(0, token.find('='));
+         first = false;
+      }
+      else if (token.compare(0, 7, "format=") == 0) {
+         *format = token.substr(7);
+         format->erase(std::remove(format->begin(), format->end(), '"'), format->end());
+      }
+   }
+}
+
+static void startWriting(Client *client)
+{
+   for (auto &agent : client->agents) {
+      closeConnection(&agent->connection);
+   }
+   client->state = CLIENT_WRITING;
+   client->deadline = monotonicMillis() + options.timeout_millis;
+   watch(&client->connection, EPOLL_CTL_MOD, EPOLLOUT);
+}
+
+static void appendLabeled(std::string *output, const std::string &label, const std::string &response, bool folded)
+{
+   size_t p = 0;
+   while (p < response.size()) {
+      size_t end = response.find('\n', p);
+      if (end == std::string::npos) {
+         end = response.size();
+      }
+      std::string line = response.substr(p, end - p);
+      p = end + 1;
+
+      size_t colon = line.find(": ");
+      if ((line.compare(0, 7, "ERROR: ") == 0) || (line.compare(0, 9, "WARNING: ") == 0)) {
+         *output += line.substr(0, colon + 2) + label + ": " + line.substr(colon + 2) + "\n";
+      }
+      else if (!folded) {
+         *output += line + "\n";
+      }
+      else if (!line.empty()) {
+         *output += label + ";" + line + "\n";
+      }
+   }
+}
+
+// merge the responses in pid order, after all agents answered or the
+// timeout expired
+static void finishRequest(Client *client, const std::string &command, const std::string &format)
+{
+   bool folded = (command == "profile") || (command == "delta") || (format == "folded");
+   if (client->agents.empty()) {
+      client->output = "WARNING: no agents in " + options.socket_dir + "\n";
+   }
+   for (auto &agent : client->agents) {
+      if ((agent->connection.fd != -1) && agent->error.empty()) {
+         agent->error = "timed out";
+      }
+      if (!agent->error.empty()) {
+         client->output += "WARNING: " + agent->label + ": " + agent->error + "\n";
+         continue;
+      }
+      if (!folded) {
+         client->output += "Process " + agent->label + ":\n";
+      }
+      appendLabeled(&client->output, agent->label, agent->response, folded);
+   }
+   startWriting(client);
+}
+
+static void finishRequest(Client *client)
+{
+   std::string command;
+   std::string format;
+   parseRequest(client->request, &command, &format);
+   finishRequest(client, command, format);
+}
+
+static void listAgents(Client *client)
+{
+   for (pid_t pid : discoverAgents()) {
+      char line[64];
+      snprintf(line, sizeof(line), "%d ", pid);
+      client->output += line + processLabel(pid) + "\n";
+   }
+   startWriting(client);
+}
+
+static void connectAgent(Client *client, pid_t pid)
+{
+   client->agents.emplace_back(new Agent());
+   Agent *agent = client->agents.back().get();
+   agent->pid = pid;
+   agent->label = processLabel(pid);
+   agent->connection.kind = CONNECTION_AGENT;
+   agent->connection.client = client;
+   agent->connection.agent = agent;
+
+   sockaddr_un addr = {};
+   addr.sun_family = AF_UNIX;
+   snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/astack-%d.sock", options.socket_dir.c_str(), pid);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (fd == -1) {
+      agent->error = strerror(errno);
+      return;
+   }
+   if (connect(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+      agent->error = strerror(errno);
+      close(fd);
+      return;
+   }
+   agent->connection.fd = fd;
+   client->pending++;
+   watch(&agent->connection, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void startRequest(Client *client)
+{
+   // only the first line is forwarded, like the agent reads it
+   size_t newline = client->request.find('\n');
+   if (newline != std::string::npos) {
+      client->request.resize(newline);
+   }
+
+   std::string command;
+   std::string format;
+   parseRequest(client->request, &command, &format);
+   if (command == "processes") {
+      listAgents(client);
+      return;
+   }
+   if ((format == "binary") || (format == "pprof") || (command == "timeline")) {
+      // these are single documents, with IDs that are only unique per process
+      client->output = "ERROR: binary, pprof and timeline responses are not merged, request the agents directly\n";
+      startWriting(client);
+      return;
+   }
+
+   // the agent no longer reads after the request, so it can't block
+   client->state = CLIENT_WAITING;
+   client->deadline = monotonicMillis() + options.timeout_millis;
+   client->request += '\n';
+   watch(&client->connection, EPOLL_CTL_MOD, 0);
+   for (pid_t pid : discoverAgents()) {
+      connectAgent(client, pid);
+   }
+   if (client->pending == 0) {
+      finishRequest(client, command, format);
+   }
+}
+
+static void agentDone(Agent *agent, const char *error)
+{
+   if (error != nullptr) {
+      agent->error = error;
+   }
+   closeConnection(&agent->connection);
+   Client *client = agent->connection.client;
+   if (--client->pending == 0) {
+      finishRequest(client);
+   }
+}
+
+static void writeAgent(Agent *agent)
+{
+   const std::string &request = agent->connection.client->request;
+   ssize_t n = send(agent->connection.fd, request.data() + agent->sent, request.size() - agent->sent, MSG_NOSIGNAL);
+   if (n < 0) {
+      if ((errno != EAGAIN) && (errno != EINTR)) {
+         agentDone(agent, strerror(errno));
+      }
+      return;
+   }
+   agent->sent += n;
+   if (agent->sent == request.size()) {
+      watch(&agent->connection, EPOLL_CTL_MOD, EPOLLIN);
+   }
+}
+
+static void readAgent(Agent *agent)
+{
+   char buffer[64 * 1024];
+   while (true) {
+      ssize_t n = recv(agent->connection.fd, buffer, sizeof(buffer), 0);
+      if (n > 0) {
+         agent->response.append(buffer, n);
+         continue;
+      }
+      if (n == 0) {
+         agentDone(agent, nullptr);
+      }
+      else if ((errno != EAGAIN) && (errno != EINTR)) {
+         agentDone(agent, strerror(errno));
+      }
+      return;
+   }
+}
+
+static void closeClient(Client *client)
+{
+   for (auto &agent : client->agents) {
+      closeConnection(&agent->connection);
+   }
+   closeConnection(&client->connection);
+   client->state = CLIENT_CLOSED;
+}
+
+static void readClient(Client *client)
+{
+   char buffer[MAX_REQUEST_SIZE];
+   ssize_t n = recv(client->connection.fd, buffer, sizeof(buffer), 0);
+   if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+      return;
+   }
+   // a client that sends nothing gets the default thread dump
+   if (n > 0) {
+      client->request.append(buffer, n);
+   }
+   if ((n <= 0) || (client->request.find('\n') != std::string::npos) || (client->request.size() >= MAX_REQUEST_SIZE)) {
+      startRequest(client);
+   }
+}
+
+static void writeClient(Client *client)
+{
+   while (client->written < client->output.size()) {
+      ssize_t n = send(client->connection.fd, client->output.data() + client->written,
+            client->output.size() - client->written, MSG_NOSIGNAL);
+      if (n < 0) {
+         if ((errno != EAGAIN) && (errno != EINTR)) {
+            closeClient(client);
+         }
+         return;
+      }
+      client->written += n;
+   }
+   closeClient(client);
+}
+
+static void acceptClients(int server)
+{
+   while (true) {
+      int fd = accept4(server, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd == -1) {
+         return;
+      }
+      clients.emplace_back(new Client());
+      Client *client = clients.back().get();
+      client->connection.kind = CONNECTION_CLIENT;
+      client->connection.fd = fd;
+      client->connection.client = client;
+      client->deadline = monotonicMillis() + REQUEST_TIMEOUT_MILLIS;
+      watch(&client->connection, EPOLL_CTL_ADD, EPOLLIN);
+   }
+}
+
+static void handleEvent(Connection *connection, uint32_t events)
+{
+   // closed earlier in the same batch of events
+   if (connection->fd == -1) {
+      return;
+   }
+   Client *client = connection->client;
+   switch (connection->kind) {
+      case CONNECTION_LISTENER:
+         acceptClients(connection->fd);
+         break;
+      case CONNECTION_CLIENT:
+         if (client->state == CLIENT_READING) {
+            readClient(client);
+         }
+         else if (client->state == CLIENT_WRITING) {
+            writeClient(client);
+         }
+         else if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+            closeClient(client);
+         }
+         break;
+      case CONNECTION_AGENT:
+         if ((events & EPOLLOUT) != 0) {
+            writeAgent(connection->agent);
+         }
+         else {
+            readAgent(connection->agent);
+         }
+         break;
+   }
+}
+
+// time until the nearest deadline, after acting on those that passed
+static int expireClients()
+{
+   int64_t now = monotonicMillis();
+   int64_t next = -1;
+   for (auto &client : clients) {
+      if ((client->state != CLIENT_CLOSED) && (client->deadline <= now)) {
+         if (client->state == CLIENT_READING) {
+            startRequest(client.get());
+         }
+         else if (client->state == CLIENT_WAITING) {
+            finishRequest(client.get());
+         }
+         else {
+            closeClient(client.get());
+         }
+      }
+      if (client->state != CLIENT_CLOSED) {
+         int64_t remaining = std::max<int64_t>(client->deadline - now, 0);
+         next = (next < 0) ? remaining : std::min(next, remaining);
+      }
+   }
+
+   clients.erase(std::remove_if(clients.begin(), clients.end(), [](const std::unique_ptr<Client> &client) {
+      return client->state == CLIENT_CLOSED;
+   }), clients.end());
+   return next;
+}
+
+static int serverSocket()
+{
+   int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (fd == -1) {
+      perror("ERROR: failed to create socket");
+      exit(1);
+   }
+
+   int reuse = true;
+   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
+      perror("ERROR: failed to set socket option");
+      exit(1);
+   }
+
+   sockaddr_in6 addr = {};
+   addr.sin6_family = AF_INET6;
+   addr.sin6_port = htons(options.port);
+   addr.sin6_addr = in6addr_any;
+
+   if (bind(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+      perror("ERROR: failed to bind socket");
+      exit(1);
+   }
+
+   if (listen(fd, SOMAXCONN) == -1) {
+      perror("ERROR: failed to listen on socket");
+      exit(1);
+   }
+
+   return fd;
+}
+
+static void usage()
+{
+   fprintf(stderr,
+      "Usage: astackd --port=<port> [options]\n"
+      "\n"
+      "Serves the merged responses of the AStack agents of all local JVMs.\n"
+      "\n"
+      "  --port=<port>        TCP port for requests\n"
+      "  --socket-dir=<dir>   directory of the agent sockets (default %s)\n"
+      "  --timeout=<millis>   time to wait for the agents (default 10000)\n",
+      DEFAULT_SOCKET_DIR);
+}
+
+static bool parseArgument(const char *arg)
+{
+   const char *equals = strchr(arg, '=');
+   if (equals == nullptr) {
+      return false;
+   }
+   std::string name(arg, equals - arg);
+   const char *value = equals + 1;
+
+   if (name == "--port") {
+      return parseLong(value, &options.port) && (options.port > 0) && (options.port <= 65535);
+   }
+   if (name == "--socket-dir") {
+      options.socket_dir = value;
+      return *value != '\0';
+   }
+   if (name == "--timeout") {
+      return parseLong(value, &options.timeout_millis) && (options.timeout_millis > 0);
+   }
+   return false;
+}
+
+int main(int argc, char **argv)
+{
+   for (int i = 1; i < argc; i++) {
+      if (!parseArgument(argv[i])) {
+         fprintf(stderr, "ERROR: invalid argument: %s\n", argv[i]);
+         usage();
+         return 1;
+      }
+   }
+   if (options.port == 0) {
+      usage();
+      return 1;
+   }
+
+   epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (epoll_fd == -1) {
+      perror("ERROR: epoll_create1 failed");
+      return 1;
+   }
+
+   Connection listener;
+   listener.kind = CONNECTION_LISTENER;
+   listener.fd = serverSocket();
+   watch(&listener, EPOLL_CTL_ADD, EPOLLIN);
+
+   fprintf(stderr, "astackd listening on port %lld for agents in %s\n", (long long) options.port, options.socket_dir.c_str());
+
+   epoll_event events[MAX_EVENTS];
+   while (true) {
+      int timeout = expireClients();
+      int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+      if ((count == -1) && (errno != EINTR)) {
+         perror("ERROR: epoll_wait failed");
+         return 1;
+      }
+      for (int i = 0; i < count; i++) {
+         handleEvent((Connection *) events[i].data.ptr, events[i].events);
+      }
+   }
+}
@@ -0,0 +1,165 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package io.airlift.astack;
+
+import java.io.IOException;
+
+import static java.util.Objects.requireNonNull;
+
+/**
+ * Application interface to the AStack agent. The native methods are
+ * implemented by the agent library. Methods that annotate the current
+ * thread are no-ops when the JVM is running without the agent, while
+ * methods that return data throw {@link IllegalStateException}.
+ */
+public final class AStack
+{
+    /**
+     * Output formats of a snapshot.
+     */
+    public enum Format
+    {
+        /** jstack style text */
+        TEXT,
+        /** folded stacks, one line per distinct stack with a count */
+        FOLDED,
+        /** binary records as described in astack_format.h */
+        BINARY,
+    }
+
+    private static final boolean AVAILABLE = agentLoaded();
+
+    private AStack() {}
+
+    /**
+     * Returns whether the AStack agent is loaded in this JVM.
+     */
+    public static boolean isAvailable()
+    {
+        return AVAILABLE;
+    }
+
+    /**
+     * Sets the context ID of the current thread. The context is reported
+     * with every stack captured for the thread until it is changed.
+     */
+    public static void setContext(long id)
+    {
+        setContext(id, null);
+    }
+
+    /**
+     * Sets the context label of the current thread. Labels longer than
+     * 63 bytes are truncated, and whitespace is replaced with underscores.
+     */
+    public static void setContext(String label)
+    {
+        setContext(0, label);
+    }
+
+    /**
+     * Sets both the context ID and label of the current thread.
+     */
+    public static void setContext(long id, String label)
+    {
+        if (AVAILABLE) {
+            setContext0(id, label);
+        }
+    }
+
+    /**
+     * Clears the context of the current thread.
+     */
+    public static void clearContext()
+    {
+        setContext(0, null);
+    }
+
+    /**
+     * Arms a deadline for the current thread. If the thread has not called
+     * {@link #disarmDeadline()} when the timeout expires, the agent samples
+     * its stack repeatedly until it does. Arming again replaces the
+     * previous deadline.
+     */
+    public static void armDeadline(long timeoutMillis)
+    {
+        if (AVAILABLE) {
+            armDeadline0(timeoutMillis);
+        }
+    }
+
+    /**
+     * Disarms the deadline of the current thread, if any.
+     */
+    public static void disarmDeadline()
+    {
+        if (AVAILABLE) {
+            disarmDeadline0();
+        }
+    }
+
+    /**
+     * Captures the stacks of all threads without a safepoint, and returns
+     * them in the given format.
+     */
+    public static byte[] snapshot(Format format)
+    {
+        requireNonNull(format, "format is null");
+        checkAvailable();
+        return snapshot0(format.ordinal());
+    }
+
+    /**
+     * Captures the stacks of all threads without a safepoint, and writes
+     * them in the given format to a file, replacing its contents.
+     */
+    public static void snapshot(Format format, String path)
+            throws IOException
+    {
+        requireNonNull(format, "format is null");
+        requireNonNull(path, "path is null");
+        checkAvailable();
+        writeSnapshot0(format.ordinal(), path);
+    }
+
+    private static void checkAvailable()
+    {
+        if (!AVAILABLE) {
+            throw new IllegalStateException("AStack agent is not loaded");
+        }
+    }
+
+    private static boolean agentLoaded()
+    {
+        try {
+            return agentLoaded0();
+        }
+        catch (UnsatisfiedLinkError e) {
+            return false;
+        }
+    }
+
+    private static native boolean agentLoaded0();
+
+    private static native void setContext0(long id, String label);
+
+    private static native void armDeadline0(long timeoutMillis);
+
+    private static native void disarmDeadline0();
+
+    private static native byte[] snapshot0(int format);
+
+    private static native void writeSnapshot0(int format, String path)
+            throws IOException;
+}
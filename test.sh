@@ -2,19 +2,95 @@
 
 set -eu
 
+SPOOL=$(mktemp -d)
+trap 'kill $DAEMON; rm -rf $SPOOL' EXIT
+
+./astackd --port=2001 --socket-dir=$SPOOL/sockets &
+DAEMON=$!
+
 $JAVA_HOME/bin/java \
    -XX:+PrintGCApplicationStoppedTime \
-   -agentpath:$PWD/libastack.so=port=2000 \
-   -cp $PWD AStackTest 3 &
+   -agentpath:$PWD/libastack.so=port=2000,interval=100,stuck_threshold=500,fold=java.lang.Thread=Thread,timeline=100,contention=true,waits=true,alloc_interval=16384,exceptions=true,gc=true,spool_dir=$SPOOL,gasp_file=$SPOOL/gasp.bin,ring_file=$SPOOL/ring,socket_dir=$SPOOL/sockets \
+   -cp $PWD:$PWD/astack.jar AStackTest 3 &
+JAVA=$!
 
 echo "Waiting..."
 sleep 1
 TEST=/dev/tcp/localhost/2000
 
+request() {
+   exec 3<>$TEST
+   echo "$1" >&3
+   cat <&3
+   exec 3<&-
+}
+
+daemon() {
+   exec 3<>/dev/tcp/localhost/2001
+   echo "$1" >&3
+   cat <&3
+   exec 3<&-
+}
+
 echo "Testing..."
 
 grep -q '"main" prio=5' < $TEST
 grep -q 'java.lang.Thread.Stage: TIMED_WAITING (sleeping)' < $TEST
-grep -q 'at AStackTest.main(AStackTest.java:20)' < $TEST
+grep -q 'astack.context: id=42 label=test-context' < $TEST
+grep -q 'at AStackTest.main(AStackTest.java:37)' < $TEST
+request 'dump format=folded' | grep -q '^\[test-context\];AStackTest.main;\[Thread\] 1$'
+grep -q 'frames in Thread$' < $TEST
+request 'dump format=binary' | head -c 4 | grep -q 'ASTK'
+CURSOR=$(request 'dump limit=1' | grep '^astack.cursor: ' | cut -d' ' -f2)
+request "dump limit=1 cursor=$CURSOR" | grep -q ' prio='
+request 'dump class=AStackTest method=main' | grep -q '"main" prio=5'
+test -z "$(request 'dump class=com.example.' | grep 'prio=')"
+ETAG=$(request 'dump class=AStackTest method=main if-none-match=' | head -1 | cut -d' ' -f2)
+request "dump class=AStackTest method=main if-none-match=$ETAG" | grep -q "^unchanged $ETAG$"
+request 'dump format=binary if-none-match=' | grep -q '^ERROR: '
+request 'thread name=main' | grep -q 'at AStackTest.main(AStackTest.java:37)'
+test "$(request 'thread name=main count=3 interval=1' | grep -c 'astack.sample: ')" = 3
+request 'thread name="Signal Dispatcher"' | grep -q '"Signal Dispatcher" daemon'
+request snapshot | grep -q ' threads$'
+request snapshots | grep -q ' threads$'
+request diff | grep -q '^Stacks unchanged: '
+request pools | grep -q '^Pool "main": 1 threads'
+request tree | grep -q 'AStackTest.main(AStackTest.java:37)'
+request overruns | grep -q 'Deadline overrun #1: "main"'
+request 'stuck all=true' | grep -q 'astack.stuck: '
+request 'profile last=60' | grep -q '^\[test-context\];AStackTest.main;\[Thread\] [0-9]*$'
+NOW=$(($(date +%s) * 1000))
+request "delta before=0:$NOW after=0:$NOW" | grep -q '^\[test-context\];AStackTest.main;\[Thread\] \([0-9]*\) \1$'
+request 'delta format=pprof' | grep -qa 'delta'
+request 'delta format=pprof' | grep -qa 'test-context'
+request 'timeline thread=main' | grep -q '"name": "TIMED_WAITING (sleeping)"'
+request timeline | grep -q '"name": "GC pause"'
+request gc | grep -q '^GC: [1-9][0-9]* pauses, '
+request gc | grep -q '^Bucket at .*: [0-9]* samples, [0-9]* GC pauses, '
+request contention | grep -q 'AStackTest.lambda\$contend\$0;\[java.lang.Object\] [0-9]*$'
+request waits | grep -q '^Object.wait: [1-9][0-9]* waits, [1-9][0-9]* timed out, [0-9]* ms$'
+request allocations | grep -q 'AStackTest.allocate;\[java.util.ArrayList\] [0-9]*$'
+request 'exceptions top=100' | grep -q '^Throw site #[0-9]*: java.lang.NumberFormatException, [0-9.]*/s, [0-9]* thrown$'
+request 'exceptions format=folded' | grep -q 'AStackTest.fail;.*\[java.lang.NumberFormatException\] [0-9]*$'
+request 'waits format=folded' | grep -q 'AStackTest.contend;.*\[java.lang.Object\] [0-9]*$'
+head -c 4 $SPOOL/astack-*-000000.seg | grep -q 'ASTK'
+./astack-reader --format=folded --thread=main $SPOOL/astack-*.seg | grep -q 'AStackTest.main;java.lang.Thread.sleep'
+request 'dump format=binary' > $SPOOL/dump.bin
+./astack-reader $SPOOL/dump.bin | grep -q 'at AStackTest.main(AStackTest.java:37)'
+daemon 'profile last=60' | grep -q '^AStackTest\[[0-9]*\];\[test-context\];AStackTest.main;\[Thread\] [0-9]*$'
+daemon 'thread name=main' | grep -q '^Process AStackTest\[[0-9]*\]:$'
+./astack-reader --format=folded --thread=main $SPOOL/ring | grep -q 'AStackTest.main;java.lang.Thread.sleep'
 
-wait
+wait $JAVA
+
+# written at VM death
+./astack-reader $SPOOL/gasp.bin | grep -q ' prio='
+
+# a small ring rolls over to a new dictionary many times, and the records
+# after the latest one still resolve every method
+$JAVA_HOME/bin/java \
+   -agentpath:$PWD/libastack.so=port=2002,interval=1,ring_file=$SPOOL/small-ring,ring_size=65536 \
+   -cp $PWD:$PWD/astack.jar AStackTest 1 > /dev/null
+test $(od -An -t u8 -j 32 -N 8 $SPOOL/small-ring) -gt $((4 * 65536))
+./astack-reader --format=folded $SPOOL/small-ring | grep -q 'java\.lang\.'
+test -z "$(./astack-reader --format=folded $SPOOL/small-ring | grep 'Unknown')"